@@ -0,0 +1,347 @@
+/*
+ * bench.c: end-to-end benchmark for wish.
+ *
+ * Generates synthetic batch files (many short commands, wide '&'
+ * fan-out, long argument lists, heavy '>' redirects) in a scratch
+ * directory and, for each one, reports
+ *
+ * - commands/sec and the shell's peak RSS for a batch-mode run
+ *   (`wish --stats file`), and
+ * - p50/p99 per-line latency, by driving `wish` interactively over a
+ *   pipe and timing each line from write() until the next "wish> ".
+ *
+ * Usage: bench [-n scale] [wish-binary [wish options...]]
+ * e.g.   bench ./wish --spawn=fork
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PROMPT "wish> "
+#define LATENCY_LINES 2000 // lines timed interactively per workload (x scale)
+
+static char g_dir[] = "/tmp/wish-bench-XXXXXX";
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* ===========================================================
+   ==========             WORKLOADS                  =========
+   =========================================================== */
+
+struct workload {
+    const char *name;
+    // writes the body of the batch file, returns how many commands it holds
+    unsigned long (*gen)(FILE *f, unsigned long scale);
+    unsigned long lines; // filled in by gen via the file
+};
+
+// 20000 one-word commands per scale unit
+static unsigned long gen_short(FILE *f, unsigned long scale) {
+    unsigned long n = 20000 * scale;
+    for (unsigned long i = 0; i < n; i++)
+        fputs(i % 2 ? "true\n" : "false\n", f);
+    return n;
+}
+
+// 64-way '&' lines
+static unsigned long gen_fanout(FILE *f, unsigned long scale) {
+    unsigned long lines = 300 * scale, width = 64;
+    for (unsigned long i = 0; i < lines; i++) {
+        for (unsigned long k = 0; k < width; k++)
+            fputs(k ? " & true" : "true", f);
+        fputc('\n', f);
+    }
+    return lines * width;
+}
+
+// echo with 400 arguments, output discarded
+static unsigned long gen_longargs(FILE *f, unsigned long scale) {
+    unsigned long n = 2000 * scale;
+    for (unsigned long i = 0; i < n; i++) {
+        fputs("echo", f);
+        for (int k = 0; k < 400; k++)
+            fprintf(f, " arg%d", k);
+        fputs(" > /dev/null\n", f);
+    }
+    return n;
+}
+
+// every command redirected to one of 16 files, 4 per line
+static unsigned long gen_redirect(FILE *f, unsigned long scale) {
+    unsigned long lines = 2500 * scale;
+    for (unsigned long i = 0; i < lines; i++) {
+        for (int k = 0; k < 4; k++)
+            fprintf(f, "%secho line %lu>out%lu.txt", k ? " & " : "", i, (i * 4 + k) % 16);
+        fputc('\n', f);
+    }
+    return lines * 4;
+}
+
+static struct workload g_workloads[] = {
+    { "short",    gen_short,    0 },
+    { "fanout",   gen_fanout,   0 },
+    { "longargs", gen_longargs, 0 },
+    { "redirect", gen_redirect, 0 },
+};
+
+#define NWORKLOADS (sizeof g_workloads / sizeof g_workloads[0])
+
+// Writes workload `w` to <dir>/<name>.txt; returns its command count
+static unsigned long write_workload(struct workload *w, unsigned long scale, char *path, size_t len) {
+    snprintf(path, len, "%s/%s.txt", g_dir, w->name);
+    FILE *f = fopen(path, "w");
+    if (!f)
+        die(path);
+    fputs("path /bin /usr/bin\n", f);
+    unsigned long cmds = w->gen(f, scale);
+    if (fclose(f) != 0)
+        die(path);
+
+    // count lines so latency runs know how many prompts to expect
+    f = fopen(path, "r");
+    if (!f)
+        die(path);
+    w->lines = 0;
+    for (int c; (c = fgetc(f)) != EOF; )
+        w->lines += (c == '\n');
+    fclose(f);
+    return cmds;
+}
+
+/* ===========================================================
+   ==========        BATCH-MODE THROUGHPUT           =========
+   =========================================================== */
+
+/*
+ * Runs `wish [opts] --stats file` from the scratch dir. Returns the wall
+ * time in seconds and stores the shell's own peak RSS (parsed from the
+ * --stats summary) in *rss_kb.
+ */
+static double run_batch(char **wish, int nopts, const char *file, long *rss_kb) {
+    int errp[2];
+    if (pipe(errp) != 0)
+        die("pipe");
+
+    char *args[nopts + 4];
+    int k = 0;
+    for (int i = 0; i < nopts + 1; i++)
+        args[k++] = wish[i];
+    args[k++] = "--stats";
+    args[k++] = (char *)file;
+    args[k] = NULL;
+
+    uint64_t t0 = now_ns();
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        if (chdir(g_dir) != 0)
+            _exit(127);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(errp[1], STDERR_FILENO);
+        close(errp[0]);
+        execv(args[0], args);
+        _exit(127);
+    }
+    close(errp[1]);
+
+    // the summary is short; keep the tail of stderr
+    char buf[8192];
+    size_t used = 0;
+    ssize_t r;
+    while ((r = read(errp[0], buf + used, sizeof buf - 1 - used)) > 0) {
+        used += (size_t)r;
+        if (used == sizeof buf - 1) {
+            memmove(buf, buf + used / 2, used - used / 2);
+            used -= used / 2;
+        }
+    }
+    buf[used] = '\0';
+    close(errp[0]);
+
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR) {
+    }
+    double secs = (double)(now_ns() - t0) / 1e9;
+
+    *rss_kb = ru.ru_maxrss; // fallback: includes the children's peak
+    char *p = strstr(buf, "shell max rss ");
+    if (p)
+        *rss_kb = strtol(p + strlen("shell max rss "), NULL, 10);
+    return secs;
+}
+
+/* ===========================================================
+   ==========        INTERACTIVE LATENCY             =========
+   =========================================================== */
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Reads from fd until the output seen so far ends with the prompt
+static int wait_prompt(int fd) {
+    char tail[sizeof PROMPT] = { 0 };
+    size_t plen = strlen(PROMPT);
+    char buf[4096];
+
+    for (;;) {
+        ssize_t r = read(fd, buf, sizeof buf);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+
+        // keep the last plen bytes across reads
+        if ((size_t)r >= plen) {
+            memcpy(tail, buf + r - plen, plen);
+        } else {
+            memmove(tail, tail + r, plen - (size_t)r);
+            memcpy(tail + plen - (size_t)r, buf, (size_t)r);
+        }
+        if (memcmp(tail, PROMPT, plen) == 0)
+            return 0;
+    }
+}
+
+/*
+ * Feeds up to `max` lines of `file` to an interactive wish and records
+ * how long each took. Returns the number of lines timed.
+ */
+static size_t run_latency(char **wish, int nopts, const char *file, uint64_t *lat, size_t max) {
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0)
+        die("pipe");
+
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        if (chdir(g_dir) != 0)
+            _exit(127);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        char *args[nopts + 2];
+        for (int i = 0; i < nopts + 1; i++)
+            args[i] = wish[i];
+        args[nopts + 1] = NULL;
+        execv(args[0], args);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    FILE *f = fopen(file, "r");
+    if (!f)
+        die(file);
+
+    size_t n = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    if (wait_prompt(out[0]) != 0)
+        goto done;
+    while (n < max && (len = getline(&line, &cap, f)) > 0) {
+        uint64_t t0 = now_ns();
+        if (write(in[1], line, (size_t)len) != len || wait_prompt(out[0]) != 0)
+            break;
+        lat[n++] = now_ns() - t0;
+    }
+
+done:
+    free(line);
+    fclose(f);
+    close(in[1]); // EOF makes the shell exit
+    close(out[0]);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    return n;
+}
+
+/* ===========================================================
+   ==========                 MAIN                   =========
+   =========================================================== */
+
+static void cleanup(void) {
+    char cmd[sizeof g_dir + 16];
+    snprintf(cmd, sizeof cmd, "rm -rf %s", g_dir);
+    if (system(cmd) != 0)
+        fprintf(stderr, "bench: could not remove %s\n", g_dir);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long scale = 1;
+    int i = 1;
+
+    if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+        scale = strtoul(argv[i + 1], NULL, 10);
+        if (scale == 0)
+            scale = 1;
+        i += 2;
+    }
+
+    // wish binary plus any options to pass through to it
+    char *dflt[] = { "./wish", NULL };
+    char **wish = i < argc ? &argv[i] : dflt;
+    int nopts = i < argc ? argc - i - 1 : 0;
+
+    char *abs = realpath(wish[0], NULL);
+    if (!abs || access(abs, X_OK) != 0)
+        die(wish[0]);
+    wish[0] = abs;
+
+    if (!mkdtemp(g_dir))
+        die("mkdtemp");
+    atexit(cleanup);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-10s %8s %9s %12s %10s %10s %9s\n",
+           "workload", "lines", "cmds", "cmds/sec", "p50(us)", "p99(us)", "rss(KB)");
+
+    for (size_t w = 0; w < NWORKLOADS; w++) {
+        char path[256];
+        unsigned long cmds = write_workload(&g_workloads[w], scale, path, sizeof path);
+
+        long rss;
+        double secs = run_batch(wish, nopts, path, &rss);
+
+        size_t max = LATENCY_LINES * scale;
+        uint64_t *lat = malloc(max * sizeof *lat);
+        if (!lat)
+            die("malloc");
+        size_t n = run_latency(wish, nopts, path, lat, max);
+        qsort(lat, n, sizeof *lat, cmp_u64);
+        double p50 = n ? (double)lat[n / 2] / 1e3 : 0.0;
+        double p99 = n ? (double)lat[(n * 99) / 100] / 1e3 : 0.0;
+        free(lat);
+
+        printf("%-10s %8lu %9lu %12.0f %10.1f %10.1f %9ld\n",
+               g_workloads[w].name, g_workloads[w].lines, cmds,
+               secs > 0 ? (double)cmds / secs : 0.0, p50, p99, rss);
+        fflush(stdout);
+    }
+
+    free(abs);
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * microbench.c: times the shell's parser and lookup paths in-process,
+ * away from fork/exec noise.
+ *
+ * wish.c is compiled straight into this file (its main() renamed) so
+ * the static helpers can be called directly:
+ *
+ * - lex_line() on short, wide '&', long-argument and redirect lines
+ *   (the lexer mutates its input, so each run starts from a fresh copy;
+ *   the memcpy is timed separately and subtracted)
+ * - resolve_exec() for a cached hit and for a miss across the PATH
+ * - builtin_find() for a builtin and a non-builtin
+ *
+ * Usage: microbench [iterations]
+ */
+#define main wish_main
+#include "../wish.c"
+#undef main
+
+static volatile size_t g_sink; // keeps results alive
+
+static char *repeat_line(const char *piece, const char *sep, int n) {
+    size_t plen = strlen(piece), slen = strlen(sep);
+    char *s = malloc((plen + slen) * (size_t)n + 1);
+    if (!s) { err(); exit(1); }
+    char *p = s;
+    for (int i = 0; i < n; i++) {
+        if (i) {
+            memcpy(p, sep, slen);
+            p += slen;
+        }
+        memcpy(p, piece, plen);
+        p += plen;
+    }
+    *p = '\0';
+    return s;
+}
+
+static void report(const char *name, uint64_t ns, unsigned long iters) {
+    printf("%-28s %10.1f ns/op\n", name, (double)ns / (double)iters);
+}
+
+// Times lex_line() on `text`, net of restoring the buffer each time
+static void bench_lex(const char *name, const char *text, unsigned long iters) {
+    size_t len = strlen(text);
+    char *buf = malloc(len + 1);
+    if (!buf) { err(); exit(1); }
+
+    uint64_t t0 = now_ns();
+    for (unsigned long i = 0; i < iters; i++) {
+        memcpy(buf, text, len + 1);
+        g_sink += (size_t)buf[len / 2];
+    }
+    uint64_t copy_ns = now_ns() - t0;
+
+    struct cmdlist cl;
+    t0 = now_ns();
+    for (unsigned long i = 0; i < iters; i++) {
+        memcpy(buf, text, len + 1);
+        lex_line(&g_line_arena, buf, len, &cl);
+        g_sink += cl.n;
+        arena_reset(&g_line_arena);
+    }
+    uint64_t total = now_ns() - t0;
+
+    report(name, total > copy_ns ? total - copy_ns : 0, iters);
+    free(buf);
+}
+
+static void bench_resolve(const char *name, const char *cmd, unsigned long iters) {
+    uint64_t t0 = now_ns();
+    for (unsigned long i = 0; i < iters; i++) {
+        char *p = resolve_exec(cmd);
+        g_sink += (size_t)(p != NULL);
+        free(p);
+    }
+    report(name, now_ns() - t0, iters);
+}
+
+static void bench_builtin(const char *name, const char *cmd, unsigned long iters) {
+    uint64_t t0 = now_ns();
+    for (unsigned long i = 0; i < iters; i++)
+        g_sink += (size_t)(builtin_find(cmd) != NULL);
+    report(name, now_ns() - t0, iters);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long iters = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    if (iters == 0)
+        iters = 1;
+
+    path_init();
+    builtin_init();
+    char *path_argv[] = { "path", "/usr/local/sbin", "/usr/local/bin", "/usr/sbin",
+                          "/usr/bin", "/sbin", "/bin", NULL };
+    builtin_path(path_argv);
+
+    char *wide = repeat_line("sleep 1", " & ", 200);
+    char *args = repeat_line("argument", " ", 400);
+    char *redir = repeat_line("echo line 7 > out.txt", " & ", 8);
+
+    bench_lex("lex short", "ls -la /tmp", iters);
+    bench_lex("lex 200-way &", wide, iters / 100 + 1);
+    bench_lex("lex 400 args", args, iters / 100 + 1);
+    bench_lex("lex 8 redirects", redir, iters / 10 + 1);
+    bench_resolve("resolve_exec hit (ls)", "ls", iters / 10 + 1);
+    bench_resolve("resolve_exec miss", "no-such-command", iters / 10 + 1);
+    bench_builtin("builtin_find cd", "cd", iters * 10);
+    bench_builtin("builtin_find ls", "ls", iters * 10);
+
+    free(wide);
+    free(args);
+    free(redir);
+    shell_shutdown();
+    return 0;
+}
@@ -0,0 +1,26 @@
+# Spawn throttling: forks that fail with EAGAIN back off and retry, and
+# only give up (err()) once the retries run out. RLIMIT_NPROC is what
+# makes fork() fail here, and it doesn't apply to root, so as root the
+# shell runs as an otherwise unused uid.
+[ "$(id -u)" = 0 ] && command -v setpriv > /dev/null && command -v prlimit > /dev/null || exit 77
+chmod 755 .
+mkdir w && chmod 777 w && cp "$WISH" w/wish && cd w || exit 1
+printf 'path /bin /usr/bin\nrepeat -p 12 sleep 0.2\necho done\n' > ok.txt
+printf 'path /bin /usr/bin\nsleep 0\necho after\n' > fail.txt
+
+# nproc LIMIT FILE: runs FILE with --stats under a process limit
+nproc() {
+    prlimit --nproc="$1" setpriv --reuid=54321 --regid=54321 --clear-groups \
+        ./wish --stats "$2" > out.txt 2>&1 < /dev/null
+}
+
+# room for the shell and a few children: every segment still runs
+nproc 5 ok.txt
+grep -q '^done$' out.txt && grep -q '^lines 3, jobs 13$' out.txt &&
+    grep -q '^throttled .*, 0 failed)' out.txt || { cat out.txt; exit 1; }
+
+# no room at all: each spawn gives up after its retries
+nproc 1 fail.txt
+[ "$(grep -c '^An error has occurred$' out.txt)" = 2 ] &&
+    grep -q '^throttled 2 spawns (24 retries, 2 failed)' out.txt || { cat out.txt; exit 1; }
+exit 0
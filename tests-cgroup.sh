@@ -0,0 +1,38 @@
+# --cgroup=DIR: children run in groups under DIR/wish-<pid>, one per line
+# or (--cgroup-per=job) one per child, and the shell removes them at exit.
+# Needs a cgroup2 mount we can make a directory in.
+mnt=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/self/mounts)
+[ -n "$mnt" ] && mkdir "$mnt/wish-test-$$" 2> /dev/null || exit 77
+dir=$mnt/wish-test-$$
+trap 'find "$dir" -depth -type d -exec rmdir {} \; 2> /dev/null' EXIT
+
+# every child prints its own group
+cat > batch.txt <<'X'
+path /bin /usr/bin
+cat /proc/self/cgroup & cat /proc/self/cgroup
+cat /proc/self/cgroup
+X
+
+# groups PER: how many distinct groups the three children ran in
+groups() {
+    "$WISH" --cgroup="$dir" --cgroup-per="$1" batch.txt < /dev/null 2>&1 |
+        sed -n "s,^0::.*/wish-test-$$/,,p" > out.txt
+    [ "$(grep -c '^wish-[0-9]*/g[0-9]*$' out.txt)" = 3 ] || { cat out.txt; exit 1; }
+    sort -u out.txt | wc -l
+}
+
+# a line's segments share a group, which the next line reuses
+[ "$(groups line)" = 1 ] || { echo "per line:"; cat out.txt; exit 1; }
+# two at once need two groups, the third child reuses one
+[ "$(groups job)" = 2 ] || { echo "per job:"; cat out.txt; exit 1; }
+[ -z "$(ls -d "$dir"/wish-* 2> /dev/null)" ] || { echo "left behind:"; ls -R "$dir"; exit 1; }
+
+# a shell living in DIR (plain --cgroup: its own group) moves itself into
+# a leaf first; what it leaves there is swept by the next shell
+for i in 1 2; do
+    sh -c 'echo $$ > "$1/cgroup.procs" && exec "$2" --cgroup batch.txt' sh "$dir" "$WISH" \
+        < /dev/null 2>&1 | sed -n "s,^0::.*/wish-test-$$/,,p" > out.txt
+    [ "$(grep -c '^wish-[0-9]*/g0$' out.txt)" = 3 ] || { echo "in DIR:"; cat out.txt; exit 1; }
+    [ "$(ls -d "$dir"/wish-* | wc -l)" = 1 ] || { echo "not swept:"; ls "$dir"; exit 1; }
+done
+exit 0
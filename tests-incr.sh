@@ -0,0 +1,36 @@
+# --incremental: a clean line is skipped until a file it names changes
+cat > tick.sh <<'X'
+echo ran >> ticks.txt
+cat "$@"
+X
+cat > batch.txt <<'X'
+path /bin /usr/bin
+sh tick.sh in.txt > out.txt
+deps in.txt
+sh tick.sh in.txt
+sh tick.sh nosuchfile.txt > bad.txt
+X
+echo one > in.txt
+
+# run: each time, how many lines actually ran
+run() {
+    rm -f ticks.txt
+    "$WISH" --incremental batch.txt > /dev/null 2>&1
+    n=$(cat ticks.txt 2>/dev/null | wc -l)
+    if [ "$n" != "$1" ]; then
+        echo "$2: $n lines ran, expected $1"
+        exit 1
+    fi
+}
+
+run 3 "first run"
+run 1 "unchanged (only the failed line reruns)"
+touch -d 2000-01-01 in.txt
+run 3 "input touched"
+run 1 "unchanged again"
+rm out.txt
+run 2 "output removed"
+rm batch.txt.wish-incr
+run 3 "record removed"
+[ "$(cat out.txt)" = one ] || { echo "out.txt: $(cat out.txt)"; exit 1; }
+exit 0
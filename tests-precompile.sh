@@ -0,0 +1,50 @@
+# --precompile: compiled batch files give the same output as the source,
+# and stale or corrupt ones are recompiled
+cat > batch.txt <<'X'
+path /bin /usr/bin
+echo one & echo two > two.txt
+cat two.txt
+nosuchcommand
+echo x >
+X
+printf 'one\ntwo\nAn error has occurred\nAn error has occurred\n' > want.txt
+
+# check OPTION WHAT: runs batch.txt and compares with want.txt (the
+# parallel segments' order varies)
+check() {
+    "$WISH" "$1" batch.txt > got.txt 2>&1 < /dev/null
+    sort got.txt > got.sorted
+    sort want.txt | cmp -s - got.sorted || {
+        echo "$2:"; cat got.txt; exit 1
+    }
+}
+
+for opt in --precompile --precompile=cache; do
+    mkdir -p cache
+    rm -f batch.txt.wishc cache/*
+    check $opt "$opt, first run"
+    w=$(ls batch.txt.wishc cache/*.wishc 2>/dev/null)
+    [ -n "$w" ] || { echo "$opt: nothing compiled"; exit 1; }
+    check $opt "$opt, compiled"
+
+    # stale: the source changed
+    cp batch.txt orig.txt
+    echo echo three >> batch.txt
+    printf 'three\n' >> want.txt
+    check $opt "$opt, source changed"
+    mv orig.txt batch.txt
+    head -n 4 want.txt > w.txt && mv w.txt want.txt
+    check $opt "$opt, source changed back"
+
+    # corrupt: same header, words overwritten / file cut short (the mv
+    # above gave batch.txt a new inode, so look the entry up again)
+    w=$(ls -t batch.txt.wishc cache/*.wishc 2>/dev/null | head -n 1)
+    size=$(wc -c < "$w")
+    dd if=/dev/urandom of="$w" bs=1 seek=64 count=$((size - 64)) conv=notrunc 2> /dev/null
+    check $opt "$opt, corrupt words"
+    head -c 70 "$w" > t.wishc && mv t.wishc "$w"
+    check $opt "$opt, truncated"
+    : > "$w"
+    check $opt "$opt, empty"
+done
+exit 0
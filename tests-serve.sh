@@ -0,0 +1,30 @@
+# --serve / --connect: each session starts from the warm server (its
+# path, the client's cwd), runs lines as they stream in and answers each
+# with "wish: status N, E errors"; SIGTERM stops the server
+printf 'path /bin /usr/bin\n' > init.txt
+echo 'exit 3' > three.sh
+echo 'kill -9 $$' > killed.sh
+"$WISH" --serve="$PWD/sock" init.txt < /dev/null & server=$!
+trap 'kill $server 2> /dev/null' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    [ -S sock ] && break
+    sleep 0.1
+done
+
+# session FILE WANT: streams FILE in, compares what comes back with WANT
+session() {
+    "$WISH" --connect="$PWD/sock" "$1" > got.txt 2>&1
+    printf "$2" | diff -u - got.txt || exit 1
+}
+
+printf 'echo hi\nfalse\nsh three.sh\nsh killed.sh\nnosuchcommand & echo x >\ncd /\npwd\npath\nls\n' > a.txt
+session a.txt 'hi\nwish: status 0, 0 errors\nwish: status 1, 0 errors\nwish: status 3, 0 errors\nwish: status 137, 0 errors\nAn error has occurred\nAn error has occurred\nwish: status 0, 2 errors\nwish: status 0, 0 errors\n/\nwish: status 0, 0 errors\nwish: status 0, 0 errors\nAn error has occurred\nwish: status 0, 1 errors\n'
+
+# the first session's cd and path didn't leak into the next one
+printf 'pwd\nsh three.sh\nexit\necho not run\n' > b.txt
+session b.txt "$PWD\\nwish: status 0, 0 errors\\nwish: status 3, 0 errors\\n"
+
+kill $server
+wait $server
+[ ! -e sock ] || { echo "socket left behind"; exit 1; }
+exit 0
@@ -5,15 +5,40 @@
 #include <sys/wait.h> // for waitpid()
 #include <fcntl.h>    // for open(), O_CREAT, O_WRONLY, O_TRUNC
 #include <errno.h>    // for errno values
+#include <spawn.h>    // for posix_spawn()
+#include <sys/mman.h> // for mmap() of batch files
+#include <sys/stat.h> // for fstat()
+#include <sys/resource.h> // for struct rusage, wait4()
+#include <stdint.h>
+#include <inttypes.h> // for PRIx64 in the incremental records
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>    // for PR_SET_PDEATHSIG
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>   // for socketpair(), SCM_RIGHTS
+#include <sys/un.h>       // for --serve's Unix socket
+#include <time.h>     // for clock_gettime()
+#include <sys/syscall.h>  // for SYS_clone3
+#include <linux/sched.h>  // for struct clone_args, CLONE_INTO_CGROUP
+
+extern char **environ;
 
 // The *only* allowed error message per spec
 static const char ERRMSG[] = "An error has occurred\n";
 
 /* -------- utilities -------- */
+static unsigned long g_errors = 0; // err() calls so far
+
 // Prints the official error message to STDERR
 static void err(void) {
     write(STDERR_FILENO, ERRMSG, sizeof(ERRMSG) - 1);
-    
+    g_errors++;
 }
 
 // Global variable storing the search PATH as a NULL-terminated array
@@ -65,96 +90,466 @@ static void path_free(void) {
 }
 
 /* ===========================================================
-   ==========        STRING PARSING HELPERS          =========
+   ==========        PER-LINE ARENA ALLOCATOR        ==========
    =========================================================== */
 
 /*
- * split_tokens():
- * Splits a string `s` into tokens separated by any of the given `delims`
- * (like " " or "&" or "\t"). Uses strsep() so it handles multiple
- * consecutive delimiters gracefully.
- * Returns a NULL-terminated array of strdup’d strings.
- * Caller must free with free_argv().
+ * Everything parsed out of one input line (the segment copy, tokens,
+ * argv arrays, redirect names) is bump-allocated from g_line_arena and
+ * released in one go by arena_reset() once the line's children are
+ * reaped. After the first few lines the arena is a single chunk big
+ * enough for the longest line seen, so parsing does no malloc/free.
  */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t cap;
+    size_t used;
+    char data[];
+};
 
-static char **split_tokens(char *s, const char *delims) {
-    if (!s) {
-        return NULL;
-    } 
+struct arena {
+    struct arena_chunk *head; // chunk currently handed out from
+    size_t total;             // bytes requested since the last reset
+};
 
-    char *buf = strdup(s); // makes a modifiable copy
-    if (!buf) {
-        return NULL;
+static struct arena g_line_arena;
+
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_ALIGN     (sizeof(void *))
+
+static void arena_add_chunk(struct arena *a, size_t need) {
+    size_t cap = ARENA_MIN_CHUNK;
+    while (cap < need)
+        cap *= 2;
+
+    struct arena_chunk *c = malloc(sizeof *c + cap);
+    if (!c) { err(); exit(1); }
+    c->cap = cap;
+    c->used = 0;
+    c->next = a->head;
+    a->head = c;
+}
+
+// Returns n bytes aligned for pointers; never fails (exits on OOM)
+static void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (!a->head || a->head->cap - a->head->used < n)
+        arena_add_chunk(a, n);
+
+    void *p = a->head->data + a->head->used;
+    a->head->used += n;
+    a->total += n;
+    return p;
+}
+
+// Releases everything at once. If the last line spilled into several
+// chunks, they are merged into one chunk of the combined size.
+static void arena_reset(struct arena *a) {
+    if (!a->head)
+        return;
+
+    if (a->head->next) {
+        size_t want = a->total;
+        while (a->head) {
+            struct arena_chunk *next = a->head->next;
+            free(a->head);
+            a->head = next;
+        }
+        arena_add_chunk(a, want);
+    }
+    a->head->used = 0;
+    a->total = 0;
+}
+
+static void arena_free(struct arena *a) {
+    while (a->head) {
+        struct arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->total = 0;
+}
+
+/* ===========================================================
+   ==========        RESOLVED EXECUTABLE CACHE        =========
+   =========================================================== */
+
+/*
+ * Maps a bare command name (like "ls") to the full path resolve_exec()
+ * found for it under the current g_path, so repeated commands skip the
+ * failed access() probes on earlier PATH entries. Chained hash table;
+ * flushed whenever `path` changes and by `hash -r`.
+ */
+struct hash_entry {
+    char *name;
+    char *path;
+    size_t dir;     // index of the g_path entry it was found in
+    unsigned long hits;
+    struct hash_entry *next;
+};
+
+static struct hash_entry **g_hash = NULL;
+static size_t g_hash_cap = 0;   // number of buckets (power of two)
+static size_t g_hash_count = 0; // number of entries
+static unsigned long g_hash_gen = 0; // bumped whenever a name may stop resolving
+
+// FNV-1a, good enough for short command names
+static size_t hash_str(const char *s) {
+    size_t h = 1469598103934665603ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Drops every cached entry (keeps the bucket array)
+static void hash_flush(void) {
+    for (size_t i = 0; i < g_hash_cap; i++) {
+        struct hash_entry *e = g_hash[i];
+        while (e) {
+            struct hash_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        g_hash[i] = NULL;
     }
-    char *cursor = buf;
-    
-    size_t cap = 8, n = 0;
-    char **out = malloc(cap * sizeof(char*));
-    if (!out) {
-        free(buf);
+    g_hash_count = 0;
+    g_hash_gen++;
+}
+
+// Frees the cache entirely (used on exit)
+static void hash_free(void) {
+    hash_flush();
+    free(g_hash);
+    g_hash = NULL;
+    g_hash_cap = 0;
+}
+
+static struct hash_entry *hash_lookup(const char *name) {
+    if (!g_hash)
         return NULL;
+
+    struct hash_entry *e = g_hash[hash_str(name) & (g_hash_cap - 1)];
+    for (; e; e = e->next) {
+        if (strcmp(e->name, name) == 0)
+            return e;
     }
-    char *tok;
+    return NULL;
+}
 
-    while ((tok = strsep(&cursor, delims)) != NULL) {
-        // skip empty pieces
-        if (*tok == '\0') continue;
+// Removes one entry, e.g. when its binary has disappeared
+static void hash_remove(const char *name) {
+    if (!g_hash)
+        return;
 
-        // trim whitespace on both ends
-        while (*tok == ' ' || *tok == '\t') tok++;
-        char *end = tok + strlen(tok);
-        while (end > tok && (end[-1] == ' ' || end[-1] == '\t')) end--;
-        *end = '\0';
+    struct hash_entry **pp = &g_hash[hash_str(name) & (g_hash_cap - 1)];
+    for (; *pp; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0) {
+            struct hash_entry *dead = *pp;
+            *pp = dead->next;
+            free(dead->name);
+            free(dead->path);
+            free(dead);
+            g_hash_count--;
+            g_hash_gen++;
+            return;
+        }
+    }
+}
 
-        if (*tok == '\0') continue;
+// Doubles the bucket array and rehashes existing entries
+static void hash_grow(void) {
+    size_t cap = g_hash_cap ? g_hash_cap * 2 : 64;
+    struct hash_entry **tab = calloc(cap, sizeof *tab);
+    if (!tab) { err(); exit(1); }
 
-        // expand storage if needed
-        if (n + 1 >= cap) {
-            cap *= 2;
-            char **tmp = realloc(out, cap * sizeof(char*));
-            if (!tmp) {
-                free(buf);
-                return NULL;
-            }
-            out = tmp;
+    for (size_t i = 0; i < g_hash_cap; i++) {
+        struct hash_entry *e = g_hash[i];
+        while (e) {
+            struct hash_entry *next = e->next;
+            size_t b = hash_str(e->name) & (cap - 1);
+            e->next = tab[b];
+            tab[b] = e;
+            e = next;
         }
+    }
+    free(g_hash);
+    g_hash = tab;
+    g_hash_cap = cap;
+}
 
-        // Ensures strdup succeeds.
-        char *dup = strdup(tok);
-        if (!dup) {
-            free(buf);
-            return NULL;
+// Records name -> path (copies both strings)
+static struct hash_entry *hash_insert(const char *name, const char *path) {
+    if (g_hash_count + 1 > g_hash_cap * 3 / 4)
+        hash_grow();
+
+    struct hash_entry *e = malloc(sizeof *e);
+    if (!e) { err(); exit(1); }
+    e->name = strdup(name);
+    e->path = strdup(path);
+    if (!e->name || !e->path) { err(); exit(1); }
+    e->hits = 0;
+    e->dir = 0;
+
+    size_t b = hash_str(name) & (g_hash_cap - 1);
+    e->next = g_hash[b];
+    g_hash[b] = e;
+    g_hash_count++;
+    return e;
+}
+
+/* ===========================================================
+   ==========        PATH DIRECTORY INDEX            =========
+   =========================================================== */
+
+/*
+ * A snapshot of what each absolute g_path directory contains, read once
+ * with readdir() when the path is set. resolve_exec() only probes the
+ * directories that actually hold the name, so a command that is not in
+ * the PATH fails with no syscalls at all instead of one access() per
+ * entry. inotify keeps the snapshot fresh; pathidx_sync() applies the
+ * queued changes once per line.
+ *
+ * Relative entries, directories that can't be read or watched, and ones
+ * whose watch went away are "unindexed" and simply get probed as before.
+ * inotify does not see changes made by other NFS clients; `hash -r`
+ * rescans everything.
+ */
+struct pidx_entry {
+    char *name;
+    size_t dir; // index into g_path
+    struct pidx_entry *next;
+};
+
+struct pidx_dir {
+    int wd;      // inotify watch, or -1
+    int indexed; // 0 = consult the filesystem for this directory
+};
+
+static struct pidx_entry **g_pidx = NULL;
+static size_t g_pidx_cap = 0;   // buckets (power of two)
+static size_t g_pidx_count = 0;
+static struct pidx_dir *g_pidx_dirs = NULL;
+static size_t g_pidx_ndirs = 0; // g_path entries covered
+static int g_inotify_fd = -1;
+
+#define PIDX_WATCH (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static size_t pidx_key(const char *name, size_t dir) {
+    return (hash_str(name) ^ (dir * 0x9e3779b97f4a7c15ULL)) & (g_pidx_cap - 1);
+}
+
+static void pidx_clear(void) {
+    for (size_t i = 0; i < g_pidx_cap; i++) {
+        struct pidx_entry *e = g_pidx[i];
+        while (e) {
+            struct pidx_entry *next = e->next;
+            free(e->name);
+            free(e);
+            e = next;
         }
-        
-        out[n++] = dup;
+        g_pidx[i] = NULL;
     }
+    g_pidx_count = 0;
+}
 
-    // terminate array with NULL
-    if (n + 1 >= cap) {
-        cap += 1;
-        char **tmp = realloc(out, cap * sizeof(char*));
-        if (!tmp) {
-            free(buf);
-            return NULL;
+static struct pidx_entry **pidx_slot(const char *name, size_t dir) {
+    struct pidx_entry **pp = &g_pidx[pidx_key(name, dir)];
+    for (; *pp; pp = &(*pp)->next) {
+        if ((*pp)->dir == dir && strcmp((*pp)->name, name) == 0)
+            break;
+    }
+    return pp;
+}
+
+static void pidx_grow(void) {
+    size_t cap = g_pidx_cap ? g_pidx_cap * 2 : 1024;
+    struct pidx_entry **old = g_pidx;
+    size_t oldcap = g_pidx_cap;
+
+    g_pidx = calloc(cap, sizeof *g_pidx);
+    if (!g_pidx) { err(); exit(1); }
+    g_pidx_cap = cap;
+    for (size_t i = 0; i < oldcap; i++) {
+        struct pidx_entry *e = old[i];
+        while (e) {
+            struct pidx_entry *next = e->next;
+            size_t b = pidx_key(e->name, e->dir);
+            e->next = g_pidx[b];
+            g_pidx[b] = e;
+            e = next;
         }
-        out = tmp;
     }
-    out[n] = NULL;
-    free(buf);
-    return out;
+    free(old);
+}
+
+static void pidx_add(const char *name, size_t dir) {
+    if (g_pidx_count + 1 > g_pidx_cap * 3 / 4)
+        pidx_grow();
+
+    struct pidx_entry **pp = pidx_slot(name, dir);
+    if (*pp)
+        return;
+    struct pidx_entry *e = malloc(sizeof *e);
+    if (!e) { err(); exit(1); }
+    e->name = strdup(name);
+    if (!e->name) { err(); exit(1); }
+    e->dir = dir;
+    e->next = NULL;
+    *pp = e;
+    g_pidx_count++;
+}
+
+static void pidx_del(const char *name, size_t dir) {
+    if (!g_pidx)
+        return;
+    struct pidx_entry **pp = pidx_slot(name, dir);
+    if (!*pp)
+        return;
+    struct pidx_entry *dead = *pp;
+    *pp = dead->next;
+    free(dead->name);
+    free(dead);
+    g_pidx_count--;
+}
+
+// Watches and reads g_path[i]; leaves it unindexed on any failure
+static void pidx_scan_dir(size_t i) {
+    const char *dir = g_path[i];
+    struct pidx_dir *d = &g_pidx_dirs[i];
+
+    d->wd = -1;
+    d->indexed = 0;
+    if (dir[0] != '/' || g_inotify_fd < 0)
+        return; // relative entries move with cd
+
+    // watch first so nothing created during the readdir is missed
+    d->wd = inotify_add_watch(g_inotify_fd, dir, PIDX_WATCH);
+    if (d->wd < 0)
+        return;
+
+    DIR *dp = opendir(dir);
+    if (!dp)
+        return;
+    struct dirent *de;
+    while ((de = readdir(dp))) {
+        if (de->d_type == DT_DIR)
+            continue; // covers "." and ".."; never executable
+        pidx_add(de->d_name, i);
+    }
+    closedir(dp);
+    d->indexed = 1;
+}
+
+// Frees the index and its watches (used on exit)
+static void pathidx_free(void) {
+    pidx_clear();
+    free(g_pidx);
+    g_pidx = NULL;
+    g_pidx_cap = 0;
+    free(g_pidx_dirs);
+    g_pidx_dirs = NULL;
+    g_pidx_ndirs = 0;
+    if (g_inotify_fd >= 0)
+        close(g_inotify_fd); // drops every watch
+    g_inotify_fd = -1;
+}
+
+// Re-reads every g_path directory; called whenever the path changes
+static void pathidx_rebuild(void) {
+    pathidx_free();
+    if (!g_path)
+        return;
+
+    size_t n = 0;
+    while (g_path[n])
+        n++;
+    g_pidx_dirs = calloc(n + 1, sizeof *g_pidx_dirs);
+    if (!g_pidx_dirs) { err(); exit(1); }
+    g_pidx_ndirs = n;
+
+    g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (size_t i = 0; i < n; i++)
+        pidx_scan_dir(i);
 }
 
-/* Frees token arrays created by split_tokens() */
-/* Frees token arrays created by split_tokens() */
-static void free_argv(char **argv) {
-    if (!argv){
-    return;
+// A forked --serve session can't share the server's inotify fd (each
+// event is read only once), so it keeps the snapshot under watches of
+// its own. Something that changed between the fork and the new watch
+// can be missed; `hash -r` rescans.
+static void pathidx_rewatch(void) {
+    if (g_inotify_fd < 0)
+        return;
+    close(g_inotify_fd);
+    g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (size_t i = 0; i < g_pidx_ndirs; i++) {
+        struct pidx_dir *d = &g_pidx_dirs[i];
+        if (!d->indexed)
+            continue;
+        d->wd = g_inotify_fd >= 0 ? inotify_add_watch(g_inotify_fd, g_path[i], PIDX_WATCH) : -1;
+        if (d->wd < 0)
+            d->indexed = 0;
+    }
+}
+
+// Applies queued inotify events to the index
+static void pathidx_sync(void) {
+    if (g_inotify_fd < 0)
+        return;
+
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t r = read(g_inotify_fd, buf, sizeof buf);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return;
+        g_hash_gen++; // something in the PATH changed
+
+        for (char *p = buf; p < buf + r; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof *ev + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                pathidx_rebuild(); // events were lost
+                return;
+            }
+            // the same directory can appear in the path more than once
+            for (size_t i = 0; i < g_pidx_ndirs; i++) {
+                struct pidx_dir *d = &g_pidx_dirs[i];
+                if (d->wd != ev->wd || !d->indexed)
+                    continue;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    d->indexed = 0; // the name now means something else
+                } else if (ev->len && !(ev->mask & IN_ISDIR)) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        pidx_add(ev->name, i);
+                    else
+                        pidx_del(ev->name, i);
+                }
+            }
+        }
     }
+}
 
-    for (size_t i=0; argv[i]; i++) {
-        free(argv[i]);
+// Has an indexed directory before g_path[dir] gained `name`?
+static int pathidx_shadowed(const char *name, size_t dir) {
+    for (size_t i = 0; i < dir && i < g_pidx_ndirs; i++) {
+        if (g_pidx_dirs[i].indexed && *pidx_slot(name, i))
+            return 1;
     }
-    free(argv);
+    return 0;
+}
+
+// Could g_path[i] hold `name`? (1 for unindexed directories)
+static int pathidx_may_have(size_t i, const char *name) {
+    if (i >= g_pidx_ndirs || !g_pidx_dirs[i].indexed)
+        return 1;
+    return *pidx_slot(name, i) != NULL;
 }
 
 /* ===========================================================
@@ -188,10 +583,31 @@ static char *resolve_exec(const char *cmd) {
     // Otherwise, search through g_path entries
     if (!g_path) return NULL;
 
+    // A cached hit costs one access() instead of one per PATH entry.
+    // If the binary went away, forget it and do the normal lookup.
+    // It is also dropped once an earlier (indexed) PATH entry has
+    // gained the name, which would win a fresh lookup.
+    struct hash_entry *hit = hash_lookup(cmd);
+    if (hit && pathidx_shadowed(cmd, hit->dir)) {
+        hash_remove(cmd);
+        hit = NULL;
+    }
+    if (hit) {
+        if (access(hit->path, X_OK) == 0) {
+            char *dup = strdup(hit->path);
+            if (!dup) { err(); exit(1); }
+            hit->hits++;
+            return dup;
+        }
+        hash_remove(cmd);
+    }
+
     size_t len_cmd = strlen(cmd);
     for (size_t i = 0; g_path[i]; i++) {
         if (!g_path[i] || !*g_path[i]) 
             continue; // skip empty entries
+        if (!pathidx_may_have(i, cmd))
+            continue; // not in the snapshot: no need to ask the filesystem
 
         size_t len_dir = strlen(g_path[i]);
 
@@ -208,6 +624,9 @@ static char *resolve_exec(const char *cmd) {
         snprintf(p, need, "%s/%s", g_path[i], cmd);
 
         if (access(p, X_OK) == 0) {
+            struct hash_entry *e = hash_insert(cmd, p);
+            e->dir = i;
+            e->hits++;
             return p; // caller frees
         }
         free(p);
@@ -218,377 +637,6371 @@ static char *resolve_exec(const char *cmd) {
 
 
 /* ===========================================================
-   ==========   PARSE COMMAND + HANDLE REDIRECTION   ==========
+   ==========   LEX LINE INTO COMMANDS + REDIRECTION   =========
    =========================================================== */
 
 /*
- * parse_cmd_with_redir():
- * Takes a command line segment (like "ls -l > out.txt").
- * Splits out the filename following '>' (if any) and returns
- * an argv[] for the command itself.
+ * One '&' segment of a line: a pipeline of one or more stages joined by
+ * '|'. Each stage's argv[] lives in a per-line slab in g_line_arena; the
+ * strings themselves are the input line, cut up in place.
+ */
+struct command {
+    char ***stages;  // stages[i] is the NULL-terminated argv of stage i
+    size_t nstages;
+    char *redir;     // filename after '>' (applies to the last stage), or NULL
+    int bad;         // syntax error: report with err() when we reach it
+    int append;      // it was '>>': append to redir instead of truncating
+    char *input;     // filename after '<' (the first stage's stdin), or NULL
+    char **here;     // NULL-terminated words after '<<<' (the first stage's
+                     // stdin, as one line), or NULL
+};
+
+struct cmdlist {
+    struct command *cmds;
+    size_t n;
+    int background; // the line ended in '&'
+};
+
+/*
+ * lex_line():
+ * Turns `line` (length `len`, with line[len] writable) into a list of
+ * commands in a single left-to-right pass, writing a NUL after every
+ * token so argv[] can point straight into the buffer. No copies.
  *
- * - Only ONE '>' allowed.
- * - Exactly ONE filename allowed after '>'.
- * - Returns NULL if syntax is invalid.
+ * Segments are separated by '&'; all-blank segments are dropped.
+ * Stages within a segment are separated by '|'.
+ * '>>' is '>' in append mode. '< file' feeds the first stage from a
+ * file and '<<< words...' from a here-string: every word up to the end
+ * of the stage (or a '>'), joined by spaces.
+ * A segment is marked bad when it has:
+ * - more than ONE '>' (or '>>'), or '>>>'
+ * - anything other than exactly ONE filename after '>'
+ * - no command before '>'
+ * - an empty stage ("ls |", "| wc", "a || b")
+ * - a '>' before a '|' (only the last stage can be redirected)
+ * - more than ONE of '<' / '<<<', on any stage but the first,
+ *   '<' without a filename, '<<<' without words, or '<<'
+ * A trailing '&' also marks the whole line as a background job.
  */
-// Trims leading and trailing whitespace from a string
-static char *trim_whitespace(char *string){
-    char* original_pointer = string;
-    char* backend_pointer;
+static void lex_line(struct arena *a, char *line, size_t len, struct cmdlist *out) {
+    // Every stored segment costs at least one byte plus its '&', every
+    // stage ends at a separator byte (or the end of the line) and every
+    // token is at least one byte, which bounds all three arrays by the line length.
+    char **slab = arena_alloc(a, (len + 2) * sizeof *slab);
+    char ***stages = arena_alloc(a, (len + 2) * sizeof *stages);
+    out->cmds = arena_alloc(a, (len / 2 + 2) * sizeof *out->cmds);
+    out->n = 0;
 
-    // Skip leading whitespace
-    while (*original_pointer == ' ' || *original_pointer == '\t'){
-        original_pointer++;
-    }
+    // checked before the pass below writes NULs over the separators
+    size_t end = len;
+    while (end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t'))
+        end--;
+    out->background = end > 0 && line[end - 1] == '&';
 
-    // Remove trailing whitespace
-    backend_pointer = original_pointer + strlen(original_pointer);
+    char **argv = slab;     // argv of the stage being built
+    char ***first = stages; // stage list of the segment being built
+    size_t nstages = 0;     // stages closed so far in this segment
+    size_t nargv = 0;       // tokens before '>'
+    size_t nfile = 0;       // tokens after '>'
+    int nredir = 0;         // '>' seen in this segment
+    int bad = 0;
+    char *file = NULL;      // first token after '>'
+    char *tok = NULL;       // start of the token being scanned
+    int append = 0;         // the '>' was '>>'
+    int nin = 0;            // '<' / '<<<' seen in this segment
+    char *input = NULL;     // the token after '<'
+    int want_in = 0;        // ... which comes next
+    char **words = NULL;    // '<<<' words of every segment, allocated on first use
+    size_t nwords = 0;
+    char **here = NULL;     // this segment's list in words[]
+    int in_here = 0;        // tokens are '<<<' words until the stage ends or a '>'
 
-    while (backend_pointer > original_pointer && (backend_pointer[-1] == ' ' || backend_pointer[-1] == '\t' || backend_pointer[-1] == '\n')){
-        backend_pointer--;
-    }
+    // i == len acts as one last '&' that closes the final segment
+    for (size_t i = 0; i <= len; i++) {
+        char c = i < len ? line[i] : '&';
 
-    *backend_pointer = '\0';
-    return original_pointer;
-}
+        if (c != ' ' && c != '\t' && c != '>' && c != '|' && c != '&' && c != '<') {
+            if (!tok)
+                tok = &line[i];
+            continue;
+        }
 
-static char **parse_cmd_with_redir(char *segment, char **redir_path) {
-    *redir_path = NULL;
+        // any separator ends the current token
+        if (tok) {
+            line[i] = '\0';
+            if (want_in) {
+                input = tok;
+                want_in = 0;
+            } else if (in_here) {
+                words[nwords++] = tok;
+            } else if (nredir == 0) {
+                argv[nargv++] = tok;
+            } else if (nfile++ == 0) {
+                file = tok;
+            }
+            tok = NULL;
+        }
+        if (c == ' ' || c == '\t')
+            continue;
 
-    if (!segment) {
-        err();
-        return NULL;
-    }
+        // anything but a token after '<' leaves it without a filename;
+        // a '>', '|' or '&' ends the '<<<' words
+        if (want_in)
+            bad = 1;
+        want_in = 0;
+        if (in_here && c != '<') {
+            if (&words[nwords] == here)
+                bad = 1;
+            words[nwords++] = NULL;
+            in_here = 0;
+        }
 
-    // Counts > (Requires there only to be 0 or 1 '>')
-    int redir_count = 0;
-    for (char *count = segment; *count; count++) {
-        if (*count == '>'){
-            redir_count++;
+        if (c == '>') {
+            size_t run = 1;
+            while (i + 1 < len && line[i + 1] == '>') {
+                run++;
+                i++;
+            }
+            if (run > 2)
+                bad = 1;
+            append = run == 2;
+            nredir++;
+            continue;
+        }
+        if (c == '<') {
+            size_t run = 1;
+            while (i + 1 < len && line[i + 1] == '<') {
+                run++;
+                i++;
+            }
+            if (run == 2 || run > 3 || nin++ || nstages > 0)
+                bad = 1;
+            if (run == 3 && !bad) {
+                // every token is one slot plus one NULL per '<<<', which
+                // the line length bounds just like the argv slab
+                if (!words)
+                    words = arena_alloc(a, (len + 2) * sizeof *words);
+                here = &words[nwords];
+                in_here = 1;
+            } else if (run != 3) {
+                want_in = 1;
+            }
+            continue;
         }
-    }
 
-    // If more than one '>', then NULL
-    if (redir_count > 1) {
-        err();
-        return NULL;
+        // blank segment: nothing to close
+        if (c == '&' && nstages == 0 && nargv == 0 && nredir == 0 && nin == 0)
+            continue;
+
+        // '|' or '&' closes the stage
+        if (nargv == 0 || (c == '|' && nredir))
+            bad = 1;
+        argv[nargv] = NULL;
+        first[nstages++] = argv;
+        argv += nargv + 1;
+        nargv = 0;
+        if (c == '|')
+            continue;
+
+        // end of segment
+        struct command *cmd = &out->cmds[out->n++];
+        cmd->stages = first;
+        cmd->nstages = nstages;
+        cmd->redir = nredir ? file : NULL;
+        cmd->bad = bad || nredir > 1 || (nredir == 1 && nfile != 1);
+        cmd->append = append;
+        cmd->input = input;
+        cmd->here = here;
+        first += nstages;
+        nstages = nfile = 0;
+        nredir = bad = 0;
+        file = NULL;
+        append = nin = 0;
+        input = NULL;
+        here = NULL;
     }
+}
 
-    char *cmd = segment;
-    char *filename = NULL;
+/* ===========================================================
+   ==========         RESOURCE ACCOUNTING            ==========
+   =========================================================== */
 
-    if (redir_count == 1) {
-        filename = strchr(segment, '>');
-        *filename = '\0';
-        filename++;
+/*
+ * Running totals for the whole session. Every reaped child contributes
+ * its wall time (spawn to reap) and the wait4() rusage; main() adds how
+ * long each line spent being parsed versus executed. `stats` prints
+ * them, as does --stats (to stderr) when the shell exits.
+ */
+#define STATS_TOP 10    // how many of the slowest commands to keep
+#define STATS_CMDLEN 80 // how much of each slow command line to keep
 
-        // Trim both sides
-        cmd = trim_whitespace(cmd);
-        filename = trim_whitespace(filename);
+struct slow_cmd {
+    uint64_t wall_ns;
+    char text[STATS_CMDLEN];
+};
 
-        char **tokens = split_tokens(filename, " \t");
-        if (!tokens || !tokens[0] || tokens[1]) {
-            free_argv(tokens);
-            err();
-            return NULL;
-        }
+struct stats {
+    unsigned long lines;
+    unsigned long skipped; // lines --incremental found up to date
+    unsigned long jobs;
+    uint64_t wall_ns;   // sum of per-job wall time
+    uint64_t user_ns;   // sum of child user CPU
+    uint64_t sys_ns;    // sum of child system CPU
+    long maxrss_kb;     // largest single child
+    uint64_t spawn_ns;  // time the shell spent inside spawn calls
+    unsigned long throttled; // spawns that hit EAGAIN/ENOMEM at least once
+    unsigned long retries;   // ... and how many retries they took
+    unsigned long dropped;   // ... and those that still failed
+    uint64_t backoff_ns;     // time spent backing off
+    size_t min_cap;          // lowest throttling cap reached
+    unsigned long pressure_holds; // spawns --pressure held back
+    uint64_t pressure_ns;         // ... and for how long
+    uint64_t parse_ns;  // time spent in lex_line()
+    uint64_t exec_ns;   // rest of each line: builtins, spawning, waiting
+    size_t nslow;
+    struct slow_cmd slow[STATS_TOP]; // longest first
+};
 
-        *redir_path = strdup(tokens[0]);
-        free_argv(tokens);
-    } else {
-        cmd = trim_whitespace(cmd);
-    }
+static struct stats g_stats;
+static int g_stats_at_exit = 0; // --stats
+static struct stats *g_pool_slot = NULL; // -P worker: where to leave g_stats at exit
+static const char *g_serve_path = NULL;   // --serve
+static const char *g_connect_path = NULL; // --connect
+static int g_session = 0;                 // a --serve session, not the server
 
-    char **argv = split_tokens(cmd, " \t");
-    if (!argv || !argv[0]) {
-        free_argv(argv);
-        if (*redir_path) {
-            free(*redir_path);
-            *redir_path = NULL; 
-        }
-        err();
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t tv_ns(const struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000000u + (uint64_t)tv->tv_usec * 1000u;
+}
+
+// Makes room in the slowest list for a job of `wall_ns`, or NULL if it didn't make the cut
+static struct slow_cmd *stats_slow_slot(uint64_t wall_ns) {
+    if (g_stats.nslow == STATS_TOP && g_stats.slow[STATS_TOP - 1].wall_ns >= wall_ns)
         return NULL;
+
+    size_t i = g_stats.nslow < STATS_TOP ? g_stats.nslow++ : STATS_TOP - 1;
+    while (i > 0 && g_stats.slow[i - 1].wall_ns < wall_ns) {
+        g_stats.slow[i] = g_stats.slow[i - 1];
+        i--;
+    }
+    return &g_stats.slow[i];
+}
+
+// Keeps `argv` in the slowest list if it made the cut
+static void stats_note_slow(char **argv, uint64_t wall_ns) {
+    struct slow_cmd *sc = stats_slow_slot(wall_ns);
+    if (!sc)
+        return;
+    sc->wall_ns = wall_ns;
+    size_t off = 0;
+    sc->text[0] = '\0';
+    for (size_t k = 0; argv && argv[k] && off < sizeof sc->text - 1; k++) {
+        int w = snprintf(sc->text + off, sizeof sc->text - off, "%s%s", k ? " " : "", argv[k]);
+        if (w < 0)
+            break;
+        off += (size_t)w;
     }
+}
+
+// Called for every reaped child
+static void stats_job_done(char **argv, uint64_t wall_ns, const struct rusage *ru) {
+    g_stats.jobs++;
+    g_stats.wall_ns += wall_ns;
+    g_stats.user_ns += tv_ns(&ru->ru_utime);
+    g_stats.sys_ns += tv_ns(&ru->ru_stime);
+    if (ru->ru_maxrss > g_stats.maxrss_kb)
+        g_stats.maxrss_kb = ru->ru_maxrss;
+    stats_note_slow(argv, wall_ns);
+}
+
+static void stats_print(FILE *out) {
+    const struct stats *st = &g_stats;
+    double spawn_us = st->jobs ? (double)st->spawn_ns / 1e3 / (double)st->jobs : 0.0;
+
+    if (st->skipped)
+        fprintf(out, "lines %lu (%lu skipped), jobs %lu\n", st->lines, st->skipped, st->jobs);
+    else
+        fprintf(out, "lines %lu, jobs %lu\n", st->lines, st->jobs);
+    fprintf(out, "parse %.6fs, exec %.6fs\n", (double)st->parse_ns / 1e9, (double)st->exec_ns / 1e9);
+    fprintf(out, "spawn overhead %.6fs (%.1fus per job)\n", (double)st->spawn_ns / 1e9, spawn_us);
+    fprintf(out, "job wall %.6fs, user %.6fs, sys %.6fs, max rss %ld KB\n",
+            (double)st->wall_ns / 1e9, (double)st->user_ns / 1e9,
+            (double)st->sys_ns / 1e9, st->maxrss_kb);
+
+    if (st->throttled)
+        fprintf(out, "throttled %lu spawns (%lu retries, %lu failed), backoff %.6fs, "
+                "lowest cap %zu\n", st->throttled, st->retries, st->dropped,
+                (double)st->backoff_ns / 1e9, st->min_cap);
+    if (st->pressure_holds)
+        fprintf(out, "pressure held %lu spawns, %.6fs\n", st->pressure_holds,
+                (double)st->pressure_ns / 1e9);
 
-    return argv;
+    struct rusage self;
+    if (getrusage(RUSAGE_SELF, &self) == 0)
+        fprintf(out, "shell max rss %ld KB\n", self.ru_maxrss);
+
+    for (size_t i = 0; i < st->nslow; i++)
+        fprintf(out, "%10.6fs  %s\n", (double)st->slow[i].wall_ns / 1e9, st->slow[i].text);
+    fflush(out);
 }
 
 /* ===========================================================
-   ==========        BUILT-IN COMMAND HANDLER         =========
+   ==========               TRACING                  ==========
    =========================================================== */
 
 /*
- * handle_builtin():
- * Checks if argv[0] is one of the built-in commands (exit, cd, path).
- * Executes them directly inside the shell (no forking).
- * Returns 1 if handled, 0 otherwise.
+ * --trace=file.json records what the shell spends its time on: reading,
+ * parsing and running each line, every builtin and spawn, the stretches
+ * spent idle waiting for children, and each child from spawn to reap
+ * (on a row of its own, keyed by pid). Events are fixed-size records in
+ * a ring of TRACE_RING entries, so recording is a few stores; when the
+ * ring wraps the oldest events are dropped. The file is written at exit
+ * in Chrome trace-event format (chrome://tracing, ui.perfetto.dev).
+ * Workers of a -P pool each write file.json.<pid>.
  */
-static int handle_builtin(char **argv) {
-    if (!argv || !argv[0]) 
-        return 0;
+#define TRACE_RING 65536
 
-    // ======= exit =======
-    if (strcmp(argv[0], "exit") == 0) {
-        if (argv[1] != NULL) {
-            err(); 
-            return 1; // exit takes no args
-        }
-        path_free();
-        exit(0); // ends the shell
+enum trace_kind {
+    TR_READ,
+    TR_PARSE,
+    TR_LINE,    // everything after parsing: builtins, spawns, waiting
+    TR_BUILTIN,
+    TR_SPAWN,
+    TR_WAIT,    // idle in the event loop
+    TR_JOB,     // one child, spawn to reap
+};
+
+static const char *const g_trace_names[] = {
+    "read", "parse", "line", "builtin", "spawn", "wait", "job",
+};
+
+struct trace_ev {
+    uint64_t start_ns, end_ns;
+    int32_t tid;     // the shell, or the child for TR_JOB
+    int32_t arg;     // line number, child pid or exit status
+    uint8_t kind;
+    char name[23];   // command name, if any
+};
+
+static char *g_trace_path = NULL; // --trace
+static struct trace_ev *g_trace = NULL;
+static size_t g_trace_n = 0;      // events recorded (may exceed the ring)
+static uint64_t g_trace_t0 = 0;
+static pid_t g_trace_pid = 0;
+
+static void trace_rec(enum trace_kind kind, uint64_t start_ns, uint64_t end_ns,
+                      pid_t tid, long arg, const char *name) {
+    if (!g_trace)
+        return;
+    struct trace_ev *ev = &g_trace[g_trace_n++ & (TRACE_RING - 1)];
+    ev->start_ns = start_ns;
+    ev->end_ns = end_ns;
+    ev->tid = tid ? tid : g_trace_pid;
+    ev->arg = (int32_t)arg;
+    ev->kind = (uint8_t)kind;
+    if (name) {
+        strncpy(ev->name, name, sizeof ev->name - 1);
+        ev->name[sizeof ev->name - 1] = '\0';
+    } else {
+        ev->name[0] = '\0';
     }
+}
 
-    // ======= cd =======
-    if (strcmp(argv[0], "cd") == 0) {
-        if (!argv[1] || argv[2]) { // exactly one arg
-            err(); 
-            return 1; 
-        }
-        if (chdir(argv[1]) != 0) 
-            err();
-        return 1;
+static void trace_json_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
     }
+    fputc('"', f);
+}
 
-    // ======= path =======
-    if (strcmp(argv[0], "path") == 0) {
-        // clear old path
-        path_free();
+// Writes the ring out (once) and stops recording
+static void trace_flush(void) {
+    if (!g_trace)
+        return;
+    struct trace_ev *ring = g_trace;
+    g_trace = NULL;
 
-        // count new dirs (can be zero → disables externals)
-        size_t count = 0;
-        while (argv[1 + count]) 
-            count++;
+    FILE *f = fopen(g_trace_path, "w");
+    if (!f) {
+        err();
+        free(ring);
+        return;
+    }
 
-        g_path = malloc((count + 1) * sizeof(char*));
-        if (!g_path) { 
-            err(); 
-            exit(1); 
-        }
+    size_t first = g_trace_n > TRACE_RING ? g_trace_n - TRACE_RING : 0;
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"wish\"}}",
+            (int)g_trace_pid);
+    for (size_t i = first; i < g_trace_n; i++) {
+        const struct trace_ev *ev = &ring[i & (TRACE_RING - 1)];
+        const char *label = ev->name[0] ? ev->name : g_trace_names[ev->kind];
 
-        for (size_t i = 0; i < count; i++) {
-            g_path[i] = strdup(argv[1 + i]);
-            if (!g_path[i]) { 
-                err(); 
-                exit(1); 
-            }
-        }
-        g_path[count] = NULL;
-        return 1;
+        fprintf(f, ",\n{\"name\":");
+        trace_json_str(f, label);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                g_trace_names[ev->kind],
+                (double)(ev->start_ns - g_trace_t0) / 1e3,
+                (double)(ev->end_ns - ev->start_ns) / 1e3,
+                (int)g_trace_pid, (int)ev->tid);
+        if (ev->kind == TR_JOB)
+            fprintf(f, ",\"args\":{\"status\":%d}}", (int)ev->arg);
+        else if (ev->kind == TR_SPAWN)
+            fprintf(f, ",\"args\":{\"pid\":%d}}", (int)ev->arg);
+        else if (ev->kind == TR_WAIT)
+            fputc('}', f);
+        else
+            fprintf(f, ",\"args\":{\"line\":%d}}", (int)ev->arg);
     }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%zu}}\n", first);
+    if (fclose(f) != 0)
+        err();
+    free(ring);
+}
 
-    return 0; // not a built-in
+// Starts recording if --trace was given (called once the shell is set up)
+// `p` against the current directory (malloc()ed), so a later `cd`
+// doesn't change which file it names
+static char *abs_path(const char *p) {
+    char *cwd = p[0] == '/' ? NULL : getcwd(NULL, 0);
+    size_t need = (cwd ? strlen(cwd) + 1 : 0) + strlen(p) + 1;
+    char *s = malloc(need);
+    if (!s) { err(); exit(1); }
+    snprintf(s, need, "%s%s%s", cwd ? cwd : "", cwd ? "/" : "", p);
+    free(cwd);
+    return s;
 }
 
+static void trace_start(void) {
+    if (!g_trace_path)
+        return;
 
-// ========== external command handler ==========
+    g_trace_pid = getpid();
+    if (g_pool_slot || g_session) {
+        // several workers, one file each
+        size_t need = strlen(g_trace_path) + 24;
+        char *path = malloc(need);
+        if (!path) { err(); exit(1); }
+        snprintf(path, need, "%s.%d", g_trace_path, (int)g_trace_pid);
+        free(g_trace_path);
+        g_trace_path = path;
+    }
 
-// run_external():
-// Launches an external program (like /bin/ls).
-// Handles redirection (if redir_path != NULL).
-// Uses fork() + execv() + wait().
-// Parent continues after child creation.
+    g_trace = malloc(TRACE_RING * sizeof *g_trace);
+    if (!g_trace) { err(); exit(1); }
+    g_trace_n = 0;
+    g_trace_t0 = now_ns();
+    atexit(trace_flush); // also covers exits on errors
+}
 
-static pid_t run_external(char **argv, const char *redir_path) {
-    // sanity check
-    if(!argv || !argv[0]) {
-        err();
-        return -1;
-    }
-    
-    char *prog = NULL;
+/* ===========================================================
+   ==========            CPU PLACEMENT               ==========
+   =========================================================== */
 
-    // if the user provides a path (contains '/'), use it directly; otherwise search PATH
-    if (strchr(argv[0], '/')) {
-        if(access(argv[0], X_OK) != 0) {
-            err();
-            return -1;
-        }
-        prog = strdup(argv[0]);
-        if (!prog){
-            err();
+/*
+ * `affinity` (or --affinity=) pins each child the shell starts to the
+ * next entry of a round-robin list, so a wide '&' line spreads over the
+ * cores instead of leaving it to the scheduler:
+ *
+ *   affinity 0-3,8     one CPU per child, cycling through the list
+ *   affinity numa      one NUMA node per child (all of its CPUs), so
+ *   affinity numa 0,1  memory stays local to wherever the job runs
+ *   affinity off       children inherit the shell's mask again
+ *
+ * Every entry is limited to the CPUs the shell itself may use. The mask
+ * is applied in the child before execv() (fork and zygote backends); for
+ * posix_spawn() the shell switches its own mask around the call, since
+ * the child inherits it.
+ */
+static char *g_aff_spec = NULL;         // policy as given, NULL = off
+static cpu_set_t *g_aff_sets = NULL;    // the round-robin list
+static size_t g_aff_nsets = 0;
+static size_t g_aff_next = 0;
+static cpu_set_t g_aff_allowed;         // the shell's own mask
+static const cpu_set_t *g_child_cpus = NULL; // mask for the child being started, NULL = inherit
+
+// "0-3,8,10-11" -> set; returns -1 on bad syntax
+static int parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        unsigned long lo = strtoul(s, &end, 10), hi = lo;
+        if (end == s)
             return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtoul(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
         }
-    }
-    else{
-        // search PATH and fail if not found
-        if (!g_path || !g_path[0]){
-            err();
+        if (hi >= CPU_SETSIZE)
             return -1;
-        }
-
-        prog = resolve_exec(argv[0]);
-        if (!prog){
-            err();
+        for (unsigned long c = lo; c <= hi; c++)
+            CPU_SET(c, set);
+        s = end;
+        if (*s == ',')
+            s++;
+        else if (*s && *s != '\n')
             return -1;
-        }
+        else
+            break;
     }
+    return 0;
+}
 
-    // assuming that the program exists, fork a child process
-    pid_t pid = fork();
-    // if the fork fails, print error and free the memory allocated for the program
-    if (pid < 0) {
-        err();
-        free(prog);
+// Adds `set` (cut down to the allowed CPUs) to the list if anything is left
+static void aff_push(cpu_set_t *set) {
+    CPU_AND(set, set, &g_aff_allowed);
+    if (CPU_COUNT(set) == 0)
+        return;
+    cpu_set_t *sets = realloc(g_aff_sets, (g_aff_nsets + 1) * sizeof *sets);
+    if (!sets) { err(); exit(1); }
+    g_aff_sets = sets;
+    g_aff_sets[g_aff_nsets++] = *set;
+}
+
+static void aff_clear(void) {
+    free(g_aff_spec);
+    free(g_aff_sets);
+    g_aff_spec = NULL;
+    g_aff_sets = NULL;
+    g_aff_nsets = 0;
+    g_aff_next = 0;
+}
+
+// Reads a sysfs cpulist/nodelist file
+static int read_list_file(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return -1;
-    }
+    ssize_t r = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (r <= 0)
+        return -1;
+    buf[r] = '\0';
+    return parse_cpulist(buf, set);
+}
 
-    // now we are in the child process
-    if (pid == 0) {
-        // if output redirection is needed
-        if (redir_path) {
-            // create the file (if it doesn't exist), open it for writing, and truncate if it already exists
-            int fd = open(redir_path, O_CREAT|O_WRONLY|O_TRUNC, 0666);
-            
-            // if the file cannot be opened, print error and exit
-            if (fd < 0) { 
-                err(); 
-                _exit(1); 
+/*
+ * affinity_set():
+ * Installs a policy: "off", a CPU list, "numa" or "numa" plus a node
+ * list (`nodes`, may be NULL). Returns -1 (and keeps the old policy) if
+ * it is malformed or leaves no usable CPU.
+ */
+static int affinity_set(const char *spec, const char *nodes) {
+    if (strcmp(spec, "off") == 0) {
+        if (nodes)
+            return -1;
+        aff_clear();
+        return 0;
+    }
+
+    // keep the old policy around until the new one checks out
+    char *old_spec = g_aff_spec;
+    cpu_set_t *old_sets = g_aff_sets;
+    size_t old_n = g_aff_nsets;
+    g_aff_spec = NULL;
+    g_aff_sets = NULL;
+    g_aff_nsets = 0;
+
+    int ok = 0;
+    cpu_set_t set, want;
+    if (sched_getaffinity(0, sizeof g_aff_allowed, &g_aff_allowed) != 0) {
+        ok = -1;
+    } else if (strcmp(spec, "numa") == 0) {
+        // nodes missing from sysfs (no NUMA support) act as one node
+        if (nodes ? parse_cpulist(nodes, &want) != 0
+                  : read_list_file("/sys/devices/system/node/online", &want) != 0)
+            CPU_ZERO(&want);
+        if (nodes && CPU_COUNT(&want) == 0)
+            ok = -1;
+        for (int n = 0; ok == 0 && n < CPU_SETSIZE; n++) {
+            if (!CPU_ISSET(n, &want))
+                continue;
+            char path[64];
+            snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", n);
+            if (read_list_file(path, &set) == 0)
+                aff_push(&set);
+        }
+        if (!nodes && g_aff_nsets == 0) {
+            set = g_aff_allowed;
+            aff_push(&set);
+        }
+    } else if (nodes || parse_cpulist(spec, &want) != 0) {
+        ok = -1;
+    } else {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (!CPU_ISSET(c, &want))
+                continue;
+            CPU_ZERO(&set);
+            CPU_SET(c, &set);
+            aff_push(&set);
+        }
+    }
+
+    size_t len = strlen(spec) + (nodes ? strlen(nodes) + 1 : 0) + 1;
+    if (ok == 0 && g_aff_nsets > 0 && (g_aff_spec = malloc(len))) {
+        snprintf(g_aff_spec, len, "%s%s%s", spec, nodes ? " " : "", nodes ? nodes : "");
+        free(old_spec);
+        free(old_sets);
+        g_aff_next = 0;
+        return 0;
+    }
+
+    free(g_aff_sets);
+    g_aff_spec = old_spec;
+    g_aff_sets = old_sets;
+    g_aff_nsets = old_n;
+    return -1;
+}
+
+// The mask for the next child, or NULL when placement is off
+static const cpu_set_t *affinity_next(void) {
+    if (g_aff_nsets == 0)
+        return NULL;
+    const cpu_set_t *set = &g_aff_sets[g_aff_next];
+    g_aff_next = (g_aff_next + 1) % g_aff_nsets;
+    return set;
+}
+
+/* ===========================================================
+   ==========       CGROUPS AND PRESSURE             ==========
+   =========================================================== */
+
+/*
+ * --cgroup[=DIR] starts children in cgroup v2 groups of their own: one
+ * per line (--cgroup-per=line, the default) or one per child
+ * (--cgroup-per=job). A memory-hungry segment then runs into its own
+ * limit, not the host's. DIR is the shell's own cgroup by default. It
+ * must be delegated to us. The shell makes DIR/wish-<pid> and the
+ * groups g0, g1, ... inside it. A group can only hand controllers down
+ * while no process is in it, so a shell that lives in DIR first moves
+ * itself to DIR/wish-<pid>/shell (see cg_leave()). Any other process in
+ * DIR still blocks that; give such a shell a DIR of its own.
+ *
+ * Each --cgroup-limit=FILE=VALUE (memory.max=512M, pids.max=64,
+ * "cpu.max=50000 100000", ...) is written into every new group. The
+ * controllers those files belong to are enabled on the way down.
+ * Groups are reused:
+ *   - a line's group is free again once the line is done
+ *   - a job's group, once the job is reaped
+ *   - a background one, once its cgroup.events says it's empty
+ *
+ * Children are born in their group. clone3(CLONE_INTO_CGROUP) does it
+ * where the kernel has it; otherwise the child writes itself into
+ * cgroup.procs before execv(). posix_spawn() has no hook for either, so
+ * --spawn=posix takes the fork path while groups are on. The zygote
+ * gets the group's fd with each request. Remote segments aren't placed.
+ *
+ * --pressure=PCT[,CPUPCT] reads memory.pressure and cpu.pressure. These
+ * are DIR's files with --cgroup, /proc/pressure/ otherwise. While the
+ * "some" stall share since the last sample is above PCT percent
+ * (CPUPCT for cpu; PCT when not given), jobs_wait_slot() holds back new
+ * children. It lets ours finish first, but never waits with none running.
+ */
+enum cg_per {
+    CG_PER_LINE,
+    CG_PER_JOB,
+};
+
+enum {
+    CG_FREE,
+    CG_BUSY,
+    CG_BG,   // left to background jobs; free once nothing is in it
+};
+
+struct cg_limit {
+    char *file;
+    char *value;
+};
+
+struct cg_group {
+    int fd;        // the group's directory
+    int events_fd; // its cgroup.events, opened when first needed
+    int state;
+    int next_free; // CG_FREE chain, -1 at the end
+};
+
+static const char *g_cg_dir = NULL;     // --cgroup (DIR, or "" for our own), NULL = off
+static enum cg_per g_cg_per = CG_PER_LINE;
+static struct cg_limit *g_cg_limits = NULL;
+static size_t g_cg_nlimits = 0;
+static int g_cg_parent_fd = -1;         // DIR
+static int g_cg_base_fd = -1;           // DIR/wish-<pid>, -1 = off
+static char g_cg_base_name[32];
+static struct cg_group *g_cg = NULL;
+static size_t g_ncg = 0, g_cg_cap = 0;
+static int g_cg_free = -1;              // first CG_FREE group
+static int g_cg_line = -1;              // the running line's group (per line)
+static int g_cg_noclone3 = 0;           // kernel without clone3() / CLONE_INTO_CGROUP
+static int g_child_cg = -1;             // group fd for the child being started, -1 = ours
+
+// "FILE=VALUE" from --cgroup-limit; -1 if malformed
+static int cg_add_limit(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || !eq[1] || memchr(spec, '/', (size_t)(eq - spec)) ||
+        !memchr(spec, '.', (size_t)(eq - spec)))
+        return -1;
+
+    struct cg_limit *l = realloc(g_cg_limits, (g_cg_nlimits + 1) * sizeof *l);
+    if (!l) { err(); exit(1); }
+    g_cg_limits = l;
+    l = &g_cg_limits[g_cg_nlimits++];
+    l->file = strndup(spec, (size_t)(eq - spec));
+    l->value = strdup(eq + 1);
+    if (!l->file || !l->value) { err(); exit(1); }
+    return 0;
+}
+
+// Writes `s` to the file `name` under the directory `dirfd`
+static int cg_write(int dirfd, const char *name, const char *s) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    size_t n = strlen(s);
+    ssize_t w = write(fd, s, n);
+    close(fd);
+    return w == (ssize_t)n ? 0 : -1;
+}
+
+// Turns on, for the children of `dirfd`, every controller a limit needs
+static void cg_enable(int dirfd) {
+    for (size_t i = 0; i < g_cg_nlimits; i++) {
+        char ctl[64] = "+";
+        size_t n = strcspn(g_cg_limits[i].file, ".");
+        if (n == 0 || n >= sizeof ctl - 1 || strncmp(g_cg_limits[i].file, "cgroup", n) == 0)
+            continue; // cgroup.* files are always there
+        memcpy(ctl + 1, g_cg_limits[i].file, n);
+        ctl[n + 1] = '\0';
+        cg_write(dirfd, "cgroup.subtree_control", ctl); // may already be on
+    }
+}
+
+/*
+ * cg_own_dir():
+ * Finds the shell's own cgroup: the "0::" line of /proc/self/cgroup
+ * under wherever cgroup2 is mounted. Returns a malloc'd path or NULL.
+ */
+static char *cg_own_dir(void) {
+    char *line = NULL, *mnt = NULL, *rel = NULL;
+    size_t cap = 0;
+
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    while (f && !mnt && getline(&line, &cap, f) > 0) {
+        // ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS... - FSTYPE SOURCE SUPER
+        char *sep = strstr(line, " - cgroup2 ");
+        if (!sep)
+            continue;
+        char *p = line;
+        for (int k = 0; k < 4 && p; k++) {
+            p = strchr(p, ' ');
+            if (p)
+                p++;
+        }
+        if (p && p < sep)
+            mnt = strndup(p, strcspn(p, " "));
+    }
+    if (f)
+        fclose(f);
+
+    f = fopen("/proc/self/cgroup", "r");
+    while (f && !rel && getline(&line, &cap, f) > 0) {
+        if (strncmp(line, "0::", 3) == 0)
+            rel = strndup(line + 3, strcspn(line + 3, "\n"));
+    }
+    if (f)
+        fclose(f);
+    free(line);
+
+    char *dir = NULL;
+    if (mnt && rel && asprintf(&dir, "%s%s", mnt, rel) < 0)
+        dir = NULL;
+    free(mnt);
+    free(rel);
+    return dir;
+}
+
+// Creates the next group; -1 (after err()) if it can't
+static int cg_new(void) {
+    char name[32];
+    snprintf(name, sizeof name, "g%zu", g_ncg);
+    if (mkdirat(g_cg_base_fd, name, 0755) != 0 && errno != EEXIST) {
+        err();
+        return -1;
+    }
+    int fd = openat(g_cg_base_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        err();
+        return -1;
+    }
+    for (size_t i = 0; i < g_cg_nlimits; i++) {
+        if (cg_write(fd, g_cg_limits[i].file, g_cg_limits[i].value) != 0)
+            err();
+    }
+
+    if (g_ncg == g_cg_cap) {
+        g_cg_cap = g_cg_cap ? g_cg_cap * 2 : 16;
+        g_cg = realloc(g_cg, g_cg_cap * sizeof *g_cg);
+        if (!g_cg) { err(); exit(1); }
+    }
+    g_cg[g_ncg] = (struct cg_group){ fd, -1, CG_BUSY, -1 };
+    return (int)g_ncg++;
+}
+
+static void cg_release(int i) {
+    if (i < 0 || g_cg[i].state == CG_FREE)
+        return;
+    g_cg[i].state = CG_FREE;
+    g_cg[i].next_free = g_cg_free;
+    g_cg_free = i;
+}
+
+// Is anything still running in group i?
+static int cg_populated(int i) {
+    struct cg_group *g = &g_cg[i];
+    if (g->events_fd < 0)
+        g->events_fd = openat(g->fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    char buf[256];
+    ssize_t r = g->events_fd >= 0 ? pread(g->events_fd, buf, sizeof buf - 1, 0) : -1;
+    if (r <= 0)
+        return 1;
+    buf[r] = '\0';
+    return strstr(buf, "populated 0") == NULL;
+}
+
+// A group nobody is using: a free one, an emptied background one, or a new one
+static int cg_acquire(void) {
+    if (g_cg_free < 0) {
+        for (size_t i = 0; i < g_ncg; i++) {
+            if (g_cg[i].state == CG_BG && !cg_populated((int)i))
+                cg_release((int)i);
+        }
+    }
+    if (g_cg_free < 0)
+        return cg_new();
+    int i = g_cg_free;
+    g_cg_free = g_cg[i].next_free;
+    g_cg[i].state = CG_BUSY;
+    return i;
+}
+
+static void cgroup_stop(void) {
+    for (size_t i = 0; i < g_ncg; i++) {
+        char name[32];
+        snprintf(name, sizeof name, "g%zu", i);
+        close(g_cg[i].fd);
+        if (g_cg[i].events_fd >= 0)
+            close(g_cg[i].events_fd);
+        unlinkat(g_cg_base_fd, name, AT_REMOVEDIR); // fails if background jobs live on
+    }
+    if (g_cg_base_fd >= 0) {
+        close(g_cg_base_fd);
+        unlinkat(g_cg_parent_fd, g_cg_base_name, AT_REMOVEDIR);
+    }
+    if (g_cg_parent_fd >= 0)
+        close(g_cg_parent_fd);
+    free(g_cg);
+    g_cg = NULL;
+    g_ncg = g_cg_cap = 0;
+    g_cg_free = g_cg_line = -1;
+    g_cg_base_fd = g_cg_parent_fd = -1;
+    for (size_t i = 0; i < g_cg_nlimits; i++) {
+        free(g_cg_limits[i].file);
+        free(g_cg_limits[i].value);
+    }
+    free(g_cg_limits);
+    g_cg_limits = NULL;
+    g_cg_nlimits = 0;
+}
+
+// Is the shell itself in the group open at `dirfd`?
+static int cg_in_dir(int dirfd) {
+    char *own = cg_own_dir();
+    struct stat a, b;
+    int in = own && stat(own, &a) == 0 && fstat(dirfd, &b) == 0 &&
+             a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    free(own);
+    return in;
+}
+
+// Removes the DIR/wish-<pid> trees of shells that are gone (where
+// nothing lives on in them)
+static void cg_sweep(void) {
+    int fd = dup(g_cg_parent_fd);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char *end;
+        long pid = strncmp(e->d_name, "wish-", 5) == 0 ? strtol(e->d_name + 5, &end, 10) : 0;
+        if (pid <= 0 || *end || pid == (long)getpid() || kill((pid_t)pid, 0) == 0 || errno != ESRCH)
+            continue;
+
+        int base = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *bd = base >= 0 ? fdopendir(base) : NULL;
+        if (!bd) {
+            if (base >= 0)
+                close(base);
+            continue;
+        }
+        struct dirent *g;
+        while ((g = readdir(bd))) {
+            if (g->d_type == DT_DIR && g->d_name[0] != '.')
+                unlinkat(dirfd(bd), g->d_name, AT_REMOVEDIR); // fails if populated
+        }
+        closedir(bd);
+        unlinkat(dirfd(d), e->d_name, AT_REMOVEDIR);
+    }
+    closedir(d);
+}
+
+/*
+ * cg_leave():
+ * If the shell is in DIR itself, moves it to DIR/wish-<pid>/shell, so
+ * that DIR and DIR/wish-<pid> may enable controllers for their children
+ * (cgroup v2 has no internal processes). A group can't be removed while
+ * its last member is alive, so that one is left for cg_sweep() on a
+ * later run.
+ */
+static void cg_leave(void) {
+    // the root group is exempt (and has no cgroup.events)
+    if (faccessat(g_cg_parent_fd, "cgroup.events", F_OK, 0) != 0 || !cg_in_dir(g_cg_parent_fd))
+        return;
+    char name[32];
+    snprintf(name, sizeof name, "wish-%d", (int)getpid());
+    if (mkdirat(g_cg_parent_fd, name, 0755) != 0 && errno != EEXIST)
+        return;
+    int base = openat(g_cg_parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base < 0)
+        return;
+    if (mkdirat(base, "shell", 0755) == 0 || errno == EEXIST) {
+        int leaf = openat(base, "shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (leaf >= 0) {
+            cg_write(leaf, "cgroup.procs", "0");
+            close(leaf);
+        }
+    }
+    close(base);
+}
+
+/*
+ * cgroup_prepare():
+ * Opens DIR once, clears out what dead shells left in it and moves the
+ * shell out of it. A --serve or -P process calls this for the shells it
+ * forks, which then go straight to cgroup_start(). Returns -1 if DIR
+ * can't be opened.
+ */
+static int cgroup_prepare(void) {
+    if (g_cg_parent_fd >= 0)
+        return 0;
+    char *own = g_cg_dir[0] ? NULL : cg_own_dir();
+    const char *dir = g_cg_dir[0] ? g_cg_dir : own;
+    g_cg_parent_fd = dir ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    free(own);
+    if (g_cg_parent_fd < 0)
+        return -1;
+    cg_sweep();
+    cg_leave();
+    return 0;
+}
+
+/*
+ * cgroup_start():
+ * Makes DIR/wish-<pid> and checks the limits on its first group (one
+ * that can't be written is reported once and dropped). Returns -1 if
+ * the shell can't have groups there.
+ */
+static int cgroup_start(void) {
+    if (cgroup_prepare() != 0)
+        return -1;
+
+    cg_enable(g_cg_parent_fd);
+    snprintf(g_cg_base_name, sizeof g_cg_base_name, "wish-%d", (int)getpid());
+    if ((mkdirat(g_cg_parent_fd, g_cg_base_name, 0755) != 0 && errno != EEXIST) ||
+        (g_cg_base_fd = openat(g_cg_parent_fd, g_cg_base_name,
+                               O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        close(g_cg_parent_fd);
+        g_cg_parent_fd = -1;
+        return -1;
+    }
+    cg_enable(g_cg_base_fd);
+
+    struct cg_limit *limits = g_cg_limits;
+    size_t nlimits = g_cg_nlimits;
+    g_cg_nlimits = 0; // g0 is made bare, then each limit tried on it
+    int g = cg_new();
+    if (g < 0) {
+        g_cg_limits = limits;
+        g_cg_nlimits = nlimits;
+        cgroup_stop();
+        return 0; // cg_new() said why
+    }
+    for (size_t i = 0; i < nlimits; i++) {
+        if (cg_write(g_cg[g].fd, limits[i].file, limits[i].value) == 0) {
+            limits[g_cg_nlimits++] = limits[i];
+        } else {
+            err();
+            free(limits[i].file);
+            free(limits[i].value);
+        }
+    }
+    cg_release(g);
+    return 0;
+}
+
+// The group for the child about to be started (its index), or -1
+static int cg_next(void) {
+    if (g_cg_base_fd < 0)
+        return -1;
+    if (g_cg_per == CG_PER_JOB)
+        return cg_acquire();
+    if (g_cg_line < 0)
+        g_cg_line = cg_acquire();
+    return g_cg_line;
+}
+
+// A child in group i has been reaped
+static void cg_job_done(int i) {
+    if (i >= 0 && g_cg_per == CG_PER_JOB)
+        cg_release(i);
+}
+
+// A still-running child in group i now belongs to a background job
+static void cg_orphan(int i) {
+    if (i < 0)
+        return;
+    g_cg[i].state = CG_BG;
+    if (i == g_cg_line)
+        g_cg_line = -1;
+}
+
+// The line is over; the next one gets a group of its own
+static void cg_line_done(void) {
+    cg_release(g_cg_line);
+    g_cg_line = -1;
+}
+
+/*
+ * cg_fork():
+ * fork(), but the child starts in the group `cg_fd` (if >= 0): born
+ * there with clone3(), or moved by writing its pid into cgroup.procs.
+ * Placement is best effort, like affinity.
+ */
+static pid_t cg_fork(int cg_fd) {
+    if (cg_fd < 0)
+        return fork();
+
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    if (!g_cg_noclone3) {
+        struct clone_args ca;
+        memset(&ca, 0, sizeof ca);
+        ca.flags = CLONE_INTO_CGROUP;
+        ca.exit_signal = SIGCHLD;
+        ca.cgroup = (uint64_t)cg_fd;
+        long pid = syscall(SYS_clone3, &ca, sizeof ca);
+        if (pid >= 0 || errno == EAGAIN || errno == ENOMEM)
+            return (pid_t)pid;
+        if (errno == ENOSYS || errno == E2BIG)
+            g_cg_noclone3 = 1;
+    }
+#endif
+
+    pid_t pid = fork();
+    if (pid == 0)
+        cg_write(cg_fd, "cgroup.procs", "0");
+    return pid;
+}
+
+#define PSI_SAMPLE_NS 50000000  // re-read a pressure file at most every 50ms
+#define PSI_WAIT_MS 20          // then look again after this long
+
+struct psi {
+    int fd;            // memory.pressure or cpu.pressure, -1 = not watched
+    double limit;      // percent
+    uint64_t total_us; // "some" total at the last sample
+    uint64_t at_ns;    // when that was, 0 = never
+    double pct;        // stall share over the last interval
+};
+
+static struct psi g_psi_mem = { -1, 0, 0, 0, 0 };
+static struct psi g_psi_cpu = { -1, 0, 0, 0, 0 };
+
+// "PCT[,CPUPCT]" from --pressure; -1 if malformed
+static int pressure_parse(const char *s) {
+    char *end;
+    double mem = strtod(s, &end), cpu = mem;
+    if (end == s || mem <= 0)
+        return -1;
+    if (*end == ',') {
+        s = end + 1;
+        cpu = strtod(s, &end);
+        if (end == s || cpu <= 0)
+            return -1;
+    }
+    if (*end)
+        return -1;
+    g_psi_mem.limit = mem;
+    g_psi_cpu.limit = cpu;
+    return 0;
+}
+
+// Opens the pressure files; -1 if they can't be read
+static int pressure_start(void) {
+    if (g_psi_mem.limit <= 0)
+        return 0;
+    if (g_cg_parent_fd >= 0) {
+        g_psi_mem.fd = openat(g_cg_parent_fd, "memory.pressure", O_RDONLY | O_CLOEXEC);
+        g_psi_cpu.fd = openat(g_cg_parent_fd, "cpu.pressure", O_RDONLY | O_CLOEXEC);
+    } else {
+        g_psi_mem.fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+        g_psi_cpu.fd = open("/proc/pressure/cpu", O_RDONLY | O_CLOEXEC);
+    }
+    return g_psi_mem.fd >= 0 && g_psi_cpu.fd >= 0 ? 0 : -1;
+}
+
+static void pressure_stop(void) {
+    if (g_psi_mem.fd >= 0)
+        close(g_psi_mem.fd);
+    if (g_psi_cpu.fd >= 0)
+        close(g_psi_cpu.fd);
+    g_psi_mem.fd = g_psi_cpu.fd = -1;
+}
+
+// Is the "some" stall share for `p` over its limit?
+static int psi_over(struct psi *p) {
+    if (p->fd < 0)
+        return 0;
+    uint64_t now = now_ns();
+    if (p->at_ns && now - p->at_ns < PSI_SAMPLE_NS)
+        return p->pct > p->limit;
+
+    // "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+    char buf[256];
+    ssize_t r = pread(p->fd, buf, sizeof buf - 1, 0);
+    if (r <= 0)
+        return 0;
+    buf[r] = '\0';
+    double avg10;
+    unsigned long long total;
+    if (sscanf(buf, "some avg10=%lf avg60=%*f avg300=%*f total=%llu", &avg10, &total) != 2)
+        return 0;
+
+    // the kernel's 10s average only until we have an interval of our own
+    if (p->at_ns)
+        p->pct = (double)(total - p->total_us) * 1e3 * 100.0 / (double)(now - p->at_ns);
+    else
+        p->pct = avg10;
+    p->total_us = total;
+    p->at_ns = now;
+    return p->pct > p->limit;
+}
+
+static int pressure_high(void) {
+    return psi_over(&g_psi_mem) || psi_over(&g_psi_cpu);
+}
+
+/* ===========================================================
+   ==========        FORK SERVER (ZYGOTE)            ==========
+   =========================================================== */
+
+/*
+ * With --spawn=zygote, main() forks a helper right after path_init(),
+ * while the shell is still tiny. The shell then sends it spawn
+ * requests over a socketpair. Each request carries the resolved program,
+ * argv, the redirect target and the pipe ends (as SCM_RIGHTS). The helper forks
+ * the child itself, so spawn cost no longer depends on how big the
+ * shell has grown. The helper replies SPAWNED (pid) straight away and
+ * EXITED (status + rusage) when it reaps a child; the event loop reads
+ * the latter instead of calling wait4().
+ *
+ * The helper keeps its own cwd in sync: when `cd` moves the shell, the
+ * next request carries an O_PATH fd for the new directory.
+ */
+enum {
+    ZY_SPAWNED = 1,
+    ZY_EXITED  = 2,
+};
+
+struct zy_request {
+    uint32_t len;       // bytes of NUL-separated strings after the header
+    uint32_t argc;
+    uint8_t has_cwd;    // fds attached, in this order: cwd, in, out, err, cgroup
+    uint8_t has_in;
+    uint8_t has_out;
+    uint8_t has_err;
+    uint8_t has_redir;  // redirect target follows argv in the strings
+    uint8_t has_cpus;   // a cpu_set_t follows the strings
+    uint8_t has_cg;     // --cgroup: the child's group directory
+    uint8_t attach;     // not a spawn: fork a helper of its own for the
+                        // socket attached (a --serve session or -P worker),
+                        // with the second fd, if any, as its stdin, stdout
+                        // and stderr
+};
+
+struct zy_reply {
+    int32_t type;
+    int32_t pid;        // or -errno if the fork failed
+    int32_t status;
+    struct rusage ru;
+};
+
+static int g_zygote_fd = -1;     // shell end of the socketpair, -1 when off
+static pid_t g_zygote_pid = -1;
+static int g_zygote_cwd_stale = 1; // send our cwd with the next request
+
+// EXITED replies that arrived while we were waiting for a SPAWNED one
+static struct zy_reply *g_zy_pending = NULL;
+static size_t g_zy_npending = 0, g_zy_cap = 0;
+
+static int read_full(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Helper side: fork + exec one request (fork-backend error semantics)
+static pid_t zygote_child(char *prog, char **argv, int in_fd, int out_fd, int err_fd,
+                          const char *redir, const cpu_set_t *cpus, int cg_fd,
+                          const sigset_t *mask) {
+    pid_t pid = cg_fork(cg_fd);
+    if (pid != 0)
+        return pid;
+
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    if (g_serve_path) {
+        // the --serve helper ignores these (see serve_main()); programs don't
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+    if (cpus)
+        sched_setaffinity(0, sizeof *cpus, cpus); // best effort, like the other backends
+    if ((in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0) ||
+        (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0) ||
+        (err_fd >= 0 && dup2(err_fd, STDERR_FILENO) < 0)) {
+        err();
+        _exit(1);
+    }
+    if (redir) {
+        int fd = open(redir, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
+            err();
+            _exit(1);
+        }
+        close(fd);
+    }
+    execv(prog, argv);
+    err();
+    _exit(1);
+}
+
+static void zygote_main(int sock);
+
+// Helper side: reads one request and starts it. Returns -1 on EOF.
+static int zygote_serve_one(int sock, const sigset_t *mask) {
+    struct zy_request rq;
+    int fds[5];
+    char cbuf[CMSG_SPACE(sizeof fds)];
+    struct iovec iov = { &rq, sizeof rq };
+    struct msghdr mh = { 0 };
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof cbuf;
+
+    ssize_t r;
+    while ((r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (r <= 0)
+        return -1;
+    if ((size_t)r < sizeof rq && read_full(sock, (char *)&rq + r, sizeof rq - (size_t)r) != 0)
+        return -1;
+
+    size_t nfds = 0;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+        nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+    }
+
+    // one helper per session shell or worker, each the parent of what it starts
+    if (rq.attach) {
+        if (nfds >= 1 && fork() == 0) {
+            close(sock);
+            if (nfds == 2) {
+                if (dup2(fds[1], STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0 ||
+                    dup2(fds[1], STDERR_FILENO) < 0)
+                    _exit(1);
+                close(fds[1]);
             }
+            zygote_main(fds[0]);
+        }
+        for (size_t i = 0; i < nfds; i++)
+            close(fds[i]);
+        return 0;
+    }
 
-            // redirect stdout and stderr to file
-            if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
-                err();
+    char *blob = malloc(rq.len + 1);
+    char **argv = malloc((rq.argc + 1) * sizeof *argv);
+    cpu_set_t cpus;
+    if (!blob || !argv || read_full(sock, blob, rq.len) != 0 ||
+        (rq.has_cpus && read_full(sock, &cpus, sizeof cpus) != 0))
+        _exit(1);
+    blob[rq.len] = '\0';
+
+    // prog, argv[0..argc-1], then redir
+    char *p = blob;
+    char *prog = p;
+    p += strlen(p) + 1;
+    for (uint32_t i = 0; i < rq.argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[rq.argc] = NULL;
+    char *redir = rq.has_redir ? p : NULL;
+
+    size_t k = 0;
+    int cwd = rq.has_cwd && k < nfds ? fds[k++] : -1;
+    int in_fd = rq.has_in && k < nfds ? fds[k++] : -1;
+    int out_fd = rq.has_out && k < nfds ? fds[k++] : -1;
+    int err_fd = rq.has_err && k < nfds ? fds[k++] : -1;
+    int cg_fd = rq.has_cg && k < nfds ? fds[k++] : -1;
+    if (cwd >= 0) {
+        if (fchdir(cwd) != 0)
+            err();
+        close(cwd);
+    }
+
+    struct zy_reply rp = { 0 };
+    rp.type = ZY_SPAWNED;
+    rp.pid = zygote_child(prog, argv, in_fd, out_fd, err_fd, redir,
+                          rq.has_cpus ? &cpus : NULL, cg_fd, mask);
+    if (rp.pid < 0)
+        rp.pid = -errno;
+
+    if (in_fd >= 0)
+        close(in_fd);
+    if (out_fd >= 0)
+        close(out_fd);
+    if (err_fd >= 0)
+        close(err_fd);
+    if (cg_fd >= 0)
+        close(cg_fd);
+    free(blob);
+    free(argv);
+    return write_full(sock, &rp, sizeof rp);
+}
+
+// Helper main loop: requests on the socket, SIGCHLD through a signalfd
+static void zygote_main(int sock) {
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    sigdelset(&old, SIGCHLD); // children start with it unblocked
+
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+    if (sfd < 0)
+        _exit(1);
+
+    struct pollfd pf[2] = { { sock, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(pf, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+
+        if (pf[1].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(sfd, &si, sizeof si) < 0 && errno != EAGAIN)
                 _exit(1);
+
+            struct zy_reply rp = { 0 };
+            rp.type = ZY_EXITED;
+            while ((rp.pid = wait4(-1, &rp.status, WNOHANG, &rp.ru)) > 0) {
+                if (write_full(sock, &rp, sizeof rp) != 0)
+                    _exit(0);
+            }
+        }
+
+        // the shell went away (or asked us to stop by closing its end)
+        if (pf[0].revents & (POLLIN | POLLHUP)) {
+            if (zygote_serve_one(sock, &old) != 0)
+                _exit(0);
+        }
+    }
+}
+
+// Starts the helper. Returns -1 (and leaves zygote off) on failure.
+static int zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    g_zygote_fd = sv[0];
+    g_zygote_pid = pid;
+    g_zygote_cwd_stale = 1;
+    return 0;
+}
+
+static void zygote_stop(void) {
+    if (g_zygote_fd < 0)
+        return;
+    close(g_zygote_fd);
+    g_zygote_fd = -1;
+    while (waitpid(g_zygote_pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    g_zygote_pid = -1;
+    free(g_zy_pending);
+    g_zy_pending = NULL;
+    g_zy_npending = g_zy_cap = 0;
+}
+
+// Shell side: the next request re-sends our cwd (called after `cd`)
+static void zygote_note_cwd(void) {
+    g_zygote_cwd_stale = 1;
+}
+
+static int zygote_read_reply(struct zy_reply *rp) {
+    if (read_full(g_zygote_fd, rp, sizeof *rp) == 0)
+        return 0;
+
+    // the helper died: nothing it started will ever be reported
+    err();
+    exit(1);
+}
+
+// Shell side: asks the helper for a helper of its own, for a forked
+// --serve session on `conn` (or a -P worker: -1, same stdio as ours).
+// Returns the new shell's end of the new socket, or -1.
+static int zygote_attach(int conn) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        return -1;
+
+    struct zy_request rq = { 0 };
+    rq.attach = 1;
+    int fds[2] = { sv[1], conn };
+    size_t nfds = conn >= 0 ? 2 : 1;
+    char cbuf[CMSG_SPACE(sizeof fds)];
+    memset(cbuf, 0, sizeof cbuf);
+    struct iovec iov = { &rq, sizeof rq };
+    struct msghdr mh = { 0 };
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+
+    ssize_t w;
+    while ((w = sendmsg(g_zygote_fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    close(sv[1]);
+    if (w < 0 ||
+        ((size_t)w < sizeof rq && write_full(g_zygote_fd, (char *)&rq + w, sizeof rq - (size_t)w) != 0)) {
+        close(sv[0]);
+        return -1;
+    }
+    return sv[0];
+}
+
+// Shell side: asks the helper to start prog. Returns the pid or -1.
+static pid_t zygote_spawn(const char *prog, char **argv, int in_fd, int out_fd,
+                          int err_fd, const char *redir_path) {
+    struct zy_request rq = { 0 };
+    size_t len = strlen(prog) + 1;
+    for (rq.argc = 0; argv[rq.argc]; rq.argc++)
+        len += strlen(argv[rq.argc]) + 1;
+    if (redir_path)
+        len += strlen(redir_path) + 1;
+
+    char *blob = arena_alloc(&g_line_arena, len);
+    char *p = stpcpy(blob, prog) + 1;
+    for (uint32_t i = 0; i < rq.argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+    if (redir_path)
+        stpcpy(p, redir_path);
+
+    int fds[5];
+    size_t nfds = 0;
+    int cwd = -1;
+    if (g_zygote_cwd_stale) {
+        cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (cwd >= 0) {
+            fds[nfds++] = cwd;
+            rq.has_cwd = 1;
+        }
+    }
+    if (in_fd >= 0) {
+        fds[nfds++] = in_fd;
+        rq.has_in = 1;
+    }
+    if (out_fd >= 0) {
+        fds[nfds++] = out_fd;
+        rq.has_out = 1;
+    }
+    if (err_fd >= 0) {
+        fds[nfds++] = err_fd;
+        rq.has_err = 1;
+    }
+    if (g_child_cg >= 0) {
+        fds[nfds++] = g_child_cg;
+        rq.has_cg = 1;
+    }
+    rq.has_redir = redir_path != NULL;
+    rq.has_cpus = g_child_cpus != NULL;
+    rq.len = (uint32_t)len;
+
+    char cbuf[CMSG_SPACE(sizeof fds)];
+    struct iovec iov = { &rq, sizeof rq };
+    struct msghdr mh = { 0 };
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds) {
+        memset(cbuf, 0, sizeof cbuf);
+        mh.msg_control = cbuf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+
+    ssize_t w;
+    while ((w = sendmsg(g_zygote_fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    if (cwd >= 0)
+        close(cwd);
+    if (w < 0 ||
+        ((size_t)w < sizeof rq && write_full(g_zygote_fd, (char *)&rq + w, sizeof rq - (size_t)w) != 0) ||
+        write_full(g_zygote_fd, blob, len) != 0 ||
+        (g_child_cpus && write_full(g_zygote_fd, g_child_cpus, sizeof *g_child_cpus) != 0)) {
+        err();
+        exit(1);
+    }
+    if (rq.has_cwd)
+        g_zygote_cwd_stale = 0;
+
+    // exits of earlier children may come first; keep them for ev_run()
+    struct zy_reply rp;
+    for (;;) {
+        zygote_read_reply(&rp);
+        if (rp.type == ZY_SPAWNED)
+            break;
+        if (g_zy_npending == g_zy_cap) {
+            g_zy_cap = g_zy_cap ? g_zy_cap * 2 : 16;
+            g_zy_pending = realloc(g_zy_pending, g_zy_cap * sizeof *g_zy_pending);
+            if (!g_zy_pending) { err(); exit(1); }
+        }
+        g_zy_pending[g_zy_npending++] = rp;
+    }
+
+    if (rp.pid < 0) {
+        errno = -rp.pid;
+        if (errno != EAGAIN && errno != ENOMEM)
+            err(); // spawn_job() retries those
+        return -1;
+    }
+    return rp.pid;
+}
+
+// Shell side: pops an EXITED reply queued by zygote_spawn(). Returns 0
+// if there was one.
+static int zygote_pop_pending(struct zy_reply *rp) {
+    if (g_zy_npending == 0)
+        return -1;
+    *rp = g_zy_pending[0];
+    memmove(g_zy_pending, g_zy_pending + 1, --g_zy_npending * sizeof *g_zy_pending);
+    return 0;
+}
+
+/* ===========================================================
+   ==========               JOB TABLE                 =========
+   =========================================================== */
+
+/*
+ * Every child started for the current line gets a slot here.
+ * The table grows as needed. Children are reaped (see the event loop) in
+ * whatever order they exit. Each finished job keeps its wait status,
+ * timing and rusage until jobs_clear() runs at the start of the next line.
+ * g_jobmap is an open-addressing pid -> slot index so reaping stays O(1)
+ * with thousands of children.
+ */
+struct job {
+    pid_t pid;
+    int status;        // wait status, valid once done
+    int done;
+    char **argv;       // what it runs (lives as long as its line)
+    uint64_t start_ns; // when it was spawned
+    uint64_t end_ns;   // when it was reaped
+    struct rusage ru;  // from wait4(), valid once done
+    int cg;            // --cgroup: its group, -1 = none
+};
+
+static struct job *g_jobs = NULL;
+static size_t g_njobs = 0;
+static size_t g_jobs_cap = 0;
+static size_t g_jobs_running = 0;
+
+// Most children allowed to run at once (0 = unlimited). Set with -j N
+// or the `maxjobs` builtin.
+static size_t g_max_jobs = 0;
+
+/*
+ * Spawn throttling. A fork that fails with EAGAIN (RLIMIT_NPROC, pid or
+ * thread limits) or ENOMEM means "not now", so spawn_job() reaps what
+ * has finished, backs off for a jittered, doubling delay and retries
+ * instead of dropping the segment. Each such failure also lowers
+ * g_throttle_cap, a second limit next to -j, to the number of children
+ * that were running at the time (halving it if that doesn't bring it
+ * down); every THROTTLE_RECOVER clean spawns raise it by one, until it
+ * reaches -j (or, with no -j, twice the level it started at) and is
+ * lifted.
+ */
+#define SPAWN_RETRIES 12           // attempts after the first, ~3s of backoff in all
+#define THROTTLE_BASE_US 500       // first backoff; doubles per retry
+#define THROTTLE_MAX_US 500000
+#define THROTTLE_RECOVER 16
+
+static size_t g_throttle_cap = 0;  // 0 = not throttled
+static size_t g_throttle_from = 0; // jobs running when it started
+static size_t g_throttle_ok = 0;   // clean spawns since the cap last moved
+
+static size_t *g_jobmap = NULL; // slot index + 1 (0 = empty)
+static size_t g_jobmap_cap = 0; // power of two, > 2 * g_jobs_cap
+
+static size_t jobmap_slot(pid_t pid) {
+    return ((size_t)pid * 2654435761u) & (g_jobmap_cap - 1);
+}
+
+static void jobmap_put(size_t idx) {
+    if (g_jobs[idx].pid == 0)
+        return; // an in-shell utility: never reaped
+    size_t b = jobmap_slot(g_jobs[idx].pid);
+    while (g_jobmap[b])
+        b = (b + 1) & (g_jobmap_cap - 1);
+    g_jobmap[b] = idx + 1;
+}
+
+static struct job *job_find(pid_t pid) {
+    if (!g_jobmap)
+        return NULL;
+
+    for (size_t b = jobmap_slot(pid); g_jobmap[b]; b = (b + 1) & (g_jobmap_cap - 1)) {
+        struct job *j = &g_jobs[g_jobmap[b] - 1];
+        if (j->pid == pid)
+            return j;
+    }
+    return NULL;
+}
+
+// Records a freshly started child
+static struct job *job_add(pid_t pid, char **argv, uint64_t start_ns) {
+    if (g_njobs == g_jobs_cap) {
+        size_t cap = g_jobs_cap ? g_jobs_cap * 2 : 64;
+        struct job *tab = realloc(g_jobs, cap * sizeof *tab);
+        size_t *map = calloc(cap * 4, sizeof *map);
+        if (!tab || !map) { err(); exit(1); }
+        g_jobs = tab;
+        g_jobs_cap = cap;
+
+        // rehash existing slots into the bigger map
+        free(g_jobmap);
+        g_jobmap = map;
+        g_jobmap_cap = cap * 4;
+        for (size_t i = 0; i < g_njobs; i++)
+            jobmap_put(i);
+    }
+
+    struct job *j = &g_jobs[g_njobs];
+    j->pid = pid;
+    j->status = 0;
+    j->done = 0;
+    j->argv = argv;
+    j->start_ns = start_ns;
+    j->end_ns = 0;
+    j->cg = -1;
+    jobmap_put(g_njobs++);
+    g_jobs_running++;
+    return j;
+}
+
+// Forgets all finished jobs (only called once none are running)
+static void jobs_clear(void) {
+    if (g_njobs == 0)
+        return;
+    g_njobs = 0;
+    g_jobs_running = 0;
+    memset(g_jobmap, 0, g_jobmap_cap * sizeof *g_jobmap);
+}
+
+static void jobs_free(void) {
+    free(g_jobs);
+    free(g_jobmap);
+    g_jobs = NULL;
+    g_jobmap = NULL;
+    g_njobs = g_jobs_cap = g_jobmap_cap = g_jobs_running = 0;
+}
+
+/*
+ * Background jobs: an interactive line ending in '&' doesn't hold the
+ * prompt. Once its children are started they move out of the table
+ * above into a bg_job of their own (one per line), and the same event
+ * loop reaps them whenever they exit. Finished jobs are announced before
+ * the next prompt; `jobs` lists them and `wait` blocks on them. They
+ * don't count against -j.
+ */
+struct bg_job {
+    unsigned id;
+    char *text;        // the line, for `jobs`
+    pid_t *pids;       // 0 once reaped
+    size_t npids;
+    size_t running;
+    int status;        // wait status of the last process started
+    uint64_t start_ns;
+};
+
+static struct bg_job *g_bg = NULL;
+static size_t g_nbg = 0, g_bg_cap = 0;
+static size_t g_bg_running = 0; // processes, across every job
+static unsigned g_bg_next_id = 1;
+
+// Records the exit of a background process; 0 if `pid` isn't one
+static int bg_done(pid_t pid, int status, const struct rusage *ru) {
+    for (size_t i = 0; i < g_nbg; i++) {
+        struct bg_job *b = &g_bg[i];
+        for (size_t k = 0; k < b->npids; k++) {
+            if (b->pids[k] != pid)
+                continue;
+            b->pids[k] = 0;
+            b->running--;
+            g_bg_running--;
+            if (k == b->npids - 1)
+                b->status = status;
+
+            uint64_t end = now_ns();
+            char *argv[] = { b->text, NULL };
+            stats_job_done(argv, end - b->start_ns, ru);
+            trace_rec(TR_JOB, b->start_ns, end, pid, status, b->text);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bg_remove(size_t i) {
+    free(g_bg[i].text);
+    free(g_bg[i].pids);
+    memmove(&g_bg[i], &g_bg[i + 1], (g_nbg - i - 1) * sizeof *g_bg);
+    g_nbg--;
+    if (g_nbg == 0)
+        g_bg_next_id = 1;
+}
+
+// Prints one job's state, bash-style: "[1] Running  sleep 10"
+static void bg_print(const struct bg_job *b) {
+    char state[32];
+    if (b->running)
+        snprintf(state, sizeof state, "Running");
+    else if (WIFSIGNALED(b->status))
+        snprintf(state, sizeof state, "Signal %d", WTERMSIG(b->status));
+    else if (WEXITSTATUS(b->status))
+        snprintf(state, sizeof state, "Exit %d", WEXITSTATUS(b->status));
+    else
+        snprintf(state, sizeof state, "Done");
+    printf("[%u] %-10s %s\n", b->id, state, b->text);
+}
+
+/*
+ * bg_report():
+ * Prints (and forgets) the jobs that have finished; with `all`, the
+ * running ones are listed as well.
+ */
+static void bg_report(int all) {
+    for (size_t i = 0; i < g_nbg; ) {
+        if (g_bg[i].running == 0 || all)
+            bg_print(&g_bg[i]);
+        if (g_bg[i].running == 0)
+            bg_remove(i);
+        else
+            i++;
+    }
+    fflush(stdout);
+}
+
+/*
+ * bg_adopt():
+ * Turns every job of the current line into one background job shown as
+ * `text` (taking ownership of it) and empties the table for the next line.
+ */
+static void bg_adopt(char *text) {
+    if (g_nbg == g_bg_cap) {
+        g_bg_cap = g_bg_cap ? g_bg_cap * 2 : 8;
+        g_bg = realloc(g_bg, g_bg_cap * sizeof *g_bg);
+        if (!g_bg) { err(); exit(1); }
+    }
+    struct bg_job *b = &g_bg[g_nbg++];
+    b->id = g_bg_next_id++;
+    b->text = text;
+    b->pids = malloc(g_njobs * sizeof *b->pids);
+    if (!b->pids) { err(); exit(1); }
+    b->npids = g_njobs;
+    b->running = 0;
+    b->status = 0;
+    b->start_ns = g_njobs ? g_jobs[0].start_ns : now_ns();
+    for (size_t i = 0; i < g_njobs; i++) {
+        b->pids[i] = g_jobs[i].done ? 0 : g_jobs[i].pid;
+        if (!g_jobs[i].done) {
+            b->running++;
+            cg_orphan(g_jobs[i].cg);
+        }
+        else if (i == g_njobs - 1)
+            b->status = g_jobs[i].status;
+    }
+    g_bg_running += b->running;
+
+    pid_t last = g_njobs ? g_jobs[g_njobs - 1].pid : 0;
+    if (last > 0)
+        printf("[%u] %d\n", b->id, (int)last);
+    else
+        printf("[%u]\n", b->id);
+    fflush(stdout);
+
+    // they don't belong to the next line
+    g_njobs = 0;
+    g_jobs_running = 0;
+    if (g_jobmap)
+        memset(g_jobmap, 0, g_jobmap_cap * sizeof *g_jobmap);
+}
+
+static void bg_free(void) {
+    while (g_nbg)
+        bg_remove(g_nbg - 1);
+    free(g_bg);
+    g_bg = NULL;
+    g_bg_cap = 0;
+}
+
+/*
+ * job_done():
+ * Records the exit of `pid` (status and usage) if it is one of ours.
+ * Returns the job, or NULL for a pid we don't know (or a background one).
+ */
+static struct job *job_done(pid_t pid, int status, const struct rusage *ru) {
+    struct job *j = job_find(pid);
+    if (!j || j->done) {
+        bg_done(pid, status, ru);
+        return NULL;
+    }
+
+    j->status = status;
+    j->done = 1;
+    j->end_ns = now_ns();
+    j->ru = *ru;
+    g_jobs_running--;
+    cg_job_done(j->cg);
+    stats_job_done(j->argv, j->end_ns - j->start_ns, ru);
+    trace_rec(TR_JOB, j->start_ns, j->end_ns, pid, status, j->argv ? j->argv[0] : NULL);
+    return j;
+}
+
+// Records an in-shell utility's run as a job that has already exited
+// with `rc`, so its status counts wherever a child's does
+static void job_util_done(char **argv, int rc, uint64_t start_ns) {
+    struct job *j = job_add(0, argv, start_ns);
+    j->status = (rc & 0xff) << 8; // as wait() would report exit(rc)
+    j->done = 1;
+    j->end_ns = now_ns();
+    memset(&j->ru, 0, sizeof j->ru);
+    g_jobs_running--;
+}
+
+/*
+ * parse_count():
+ * Parses a non-negative decimal count (like the N in -j N).
+ * Returns 0 on success, -1 if `s` is not a plain number.
+ */
+static int parse_count(const char *s, size_t *out) {
+    if (!s || *s < '0' || *s > '9')
+        return -1;
+
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || *end)
+        return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+/* ===========================================================
+   ==========              EVENT LOOP                ==========
+   =========================================================== */
+
+/*
+ * Everything the shell waits on goes through one epoll set. SIGCHLD is
+ * blocked and read from a signalfd. The fork server's socket delivers
+ * zygote exits. Completions are handled in the order they arrive.
+ * Anything that needs to block (end of line, the -j cap) runs ev_run()
+ * until its condition holds, so new kinds of work only need an
+ * ev_source of their own.
+ */
+struct ev_source {
+    int fd;
+    void (*ready)(struct ev_source *src, uint32_t events);
+};
+
+static int g_epfd = -1;
+static sigset_t g_child_mask; // signal mask children should start with
+
+static void ev_on_sigchld(struct ev_source *src, uint32_t events);
+static void ev_on_zygote(struct ev_source *src, uint32_t events);
+
+static struct ev_source g_ev_sigchld = { -1, ev_on_sigchld };
+static struct ev_source g_ev_zygote = { -1, ev_on_zygote };
+
+// Watches `fd`; -1 if epoll won't take it (a regular file, say)
+static int ev_try_add(struct ev_source *src, int fd, uint32_t events) {
+    struct epoll_event ev = { 0 };
+    ev.events = events;
+    ev.data.ptr = src;
+    src->fd = fd;
+    return epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void ev_add(struct ev_source *src, int fd, uint32_t events) {
+    if (ev_try_add(src, fd, events) != 0) {
+        err();
+        exit(1);
+    }
+}
+
+static void ev_del(struct ev_source *src) {
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+// Reaps every child that has exited so far
+static void ev_on_sigchld(struct ev_source *src, uint32_t events) {
+    (void)events;
+    struct signalfd_siginfo si;
+    while (read(src->fd, &si, sizeof si) > 0) {
+    }
+
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+        job_done(pid, status, &ru);
+
+    // no children left at all: nothing further can finish
+    // (remote segments have negative stand-in pids and finish on their own)
+    if (pid < 0 && errno == ECHILD && g_zygote_fd < 0 && (g_jobs_running > 0 || g_bg_running > 0)) {
+        for (size_t i = 0; i < g_njobs; i++) {
+            if (!g_jobs[i].done && g_jobs[i].pid > 0) {
+                g_jobs[i].done = 1;
+                g_jobs_running--;
+                cg_job_done(g_jobs[i].cg);
+            }
+        }
+        for (size_t i = 0; i < g_nbg; i++) {
+            for (size_t k = 0; k < g_bg[i].npids; k++) {
+                if (g_bg[i].pids[k] > 0) {
+                    g_bg[i].pids[k] = 0;
+                    g_bg[i].running--;
+                    g_bg_running--;
+                }
+            }
+        }
+    }
+}
+
+// One reply from the fork server is ready
+static void ev_on_zygote(struct ev_source *src, uint32_t events) {
+    (void)src;
+    (void)events;
+    struct zy_reply rp;
+    zygote_read_reply(&rp);
+    if (rp.type == ZY_EXITED)
+        job_done(rp.pid, rp.status, &rp.ru);
+}
+
+static void ev_init(void) {
+    g_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epfd < 0) { err(); exit(1); }
+
+    // a SIGCHLD inherited as ignored would auto-reap and never fire
+    signal(SIGCHLD, SIG_DFL);
+
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &g_child_mask);
+    sigdelset(&g_child_mask, SIGCHLD);
+
+    int sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) { err(); exit(1); }
+    ev_add(&g_ev_sigchld, sfd, EPOLLIN);
+
+    if (g_zygote_fd >= 0)
+        ev_add(&g_ev_zygote, g_zygote_fd, EPOLLIN);
+}
+
+static void ev_free(void) {
+    if (g_ev_sigchld.fd >= 0)
+        close(g_ev_sigchld.fd);
+    g_ev_sigchld.fd = -1;
+    g_ev_zygote.fd = -1; // owned (and closed) by zygote_stop()
+    if (g_epfd >= 0)
+        close(g_epfd);
+    g_epfd = -1;
+}
+
+/*
+ * ev_run():
+ * Handles whatever is ready, waiting up to timeout_ms (-1 = forever)
+ * for something to be.
+ */
+static void ev_run(int timeout_ms) {
+    // exits the fork server reported while a spawn waited for its pid
+    struct zy_reply rp;
+    if (zygote_pop_pending(&rp) == 0) {
+        do {
+            job_done(rp.pid, rp.status, &rp.ru);
+        } while (zygote_pop_pending(&rp) == 0);
+        timeout_ms = 0;
+    }
+
+    struct epoll_event evs[16];
+    uint64_t t0 = g_trace && timeout_ms != 0 ? now_ns() : 0;
+    int n = epoll_wait(g_epfd, evs, 16, timeout_ms);
+    if (t0)
+        trace_rec(TR_WAIT, t0, now_ns(), 0, 0, NULL);
+    for (int i = 0; i < n; i++) {
+        struct ev_source *src = evs[i].data.ptr;
+        src->ready(src, evs[i].events);
+    }
+}
+
+// Blocks until every job started so far has exited
+static void jobs_wait_all(void) {
+    while (g_jobs_running > 0)
+        ev_run(-1);
+}
+
+// Blocks until there is room under g_max_jobs (and any throttling cap)
+// for `need` more children, and (--pressure) the host isn't stalling.
+// A pipeline wider than the cap still runs, once nothing else is.
+static void jobs_wait_slot(size_t need) {
+    uint64_t held = 0;
+    for (;;) {
+        size_t cap = g_max_jobs;
+        if (g_throttle_cap && (!cap || g_throttle_cap < cap))
+            cap = g_throttle_cap;
+        if (cap && g_jobs_running > 0 && g_jobs_running + need > cap) {
+            ev_run(-1);
+            continue;
+        }
+        if (g_jobs_running == 0 || !pressure_high())
+            break;
+        if (!held) {
+            held = now_ns();
+            g_stats.pressure_holds++;
+        }
+        ev_run(PSI_WAIT_MS);
+    }
+    if (held)
+        g_stats.pressure_ns += now_ns() - held;
+}
+
+/* ===========================================================
+   ==========            OUTPUT CAPTURE              ==========
+   =========================================================== */
+
+/*
+ * With --capture=ordered, each segment's output (stdout of its last
+ * stage, stderr of every stage) goes into a pipe that the event loop
+ * drains, and the line's outputs come out in segment order: whichever
+ * segment is first in line streams straight through, later ones are
+ * held until everything before them has finished. A segment holds at
+ * most --capture-cap bytes in memory (1 MiB by default); the rest
+ * spills to an unlinked temp file.
+ *
+ * --capture=lines instead passes complete lines through as they
+ * arrive, each prefixed with its job's number within the line ("[2] ...",
+ * counting the segments that were started).
+ *
+ * Segments with their own '>' keep writing to the file. In-shell
+ * utilities (--inline) are captured too; the other builtins print
+ * directly. A segment counts as finished when every writer has closed
+ * its pipe, so a daemon left holding it keeps the line open. Remote
+ * segments have no pipe here: their output frames are fed in as they
+ * arrive and the capture ends with the segment's exit frame.
+ */
+enum capture_mode {
+    CAPTURE_OFF,
+    CAPTURE_ORDERED,
+    CAPTURE_LINES,
+};
+
+static enum capture_mode g_capture = CAPTURE_OFF;
+static size_t g_capture_cap = 1 << 20; // --capture-cap
+
+struct capture {
+    struct ev_source src; // pipe read end (first, so src is the capture)
+    size_t seg;           // 1-based job number within the line
+    char *buf;            // held output (ordered) or a partial line (lines)
+    size_t len, cap;
+    int spill;            // temp file past g_capture_cap, or -1
+    int open;             // pipe still has writers
+};
+
+static void ev_on_capture(struct ev_source *src, uint32_t events);
+
+// This line's captures in segment order. The structs (and their
+// buffers) are kept for reuse by later lines.
+static struct capture **g_caps = NULL;
+static size_t g_ncaps = 0, g_caps_cap = 0;
+static size_t g_cap_head = 0; // ordered: first capture not fully written out
+static size_t g_cap_open = 0; // pipes still open
+static int g_cap_memfd = -1;  // scratch output for in-shell utilities
+
+static int write_all_fd(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        buf += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Takes the next capture slot for this line
+static struct capture *capture_new(void) {
+    if (g_ncaps == g_caps_cap) {
+        size_t cap = g_caps_cap ? g_caps_cap * 2 : 16;
+        g_caps = realloc(g_caps, cap * sizeof *g_caps);
+        if (!g_caps) { err(); exit(1); }
+        for (size_t i = g_caps_cap; i < cap; i++) {
+            g_caps[i] = calloc(1, sizeof **g_caps);
+            if (!g_caps[i]) { err(); exit(1); }
+            g_caps[i]->src.ready = ev_on_capture;
+            g_caps[i]->src.fd = -1;
+            g_caps[i]->spill = -1;
+        }
+        g_caps_cap = cap;
+    }
+    struct capture *c = g_caps[g_ncaps++];
+    c->seg = g_ncaps;
+    c->len = 0;
+    c->open = 0;
+    return c;
+}
+
+static void capture_hold(struct capture *c, const char *data, size_t n) {
+    if (c->len + n > c->cap) {
+        size_t cap = c->cap ? c->cap : 4096;
+        while (cap < c->len + n)
+            cap *= 2;
+        c->buf = realloc(c->buf, cap);
+        if (!c->buf) { err(); exit(1); }
+        c->cap = cap;
+    }
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+}
+
+// An unlinked scratch file for output past the memory cap
+static int capture_tmpfile(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        return fd;
+
+    size_t need = strlen(dir) + sizeof "/wish-XXXXXX";
+    char *name = arena_alloc(&g_line_arena, need);
+    snprintf(name, need, "%s/wish-XXXXXX", dir);
+    fd = mkostemp(name, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(name);
+    return fd;
+}
+
+// Writes out everything held for `c` so far
+static void capture_flush(struct capture *c) {
+    if (c->len)
+        write_all_fd(STDOUT_FILENO, c->buf, c->len);
+    c->len = 0;
+
+    if (c->spill >= 0) {
+        char chunk[65536];
+        ssize_t r;
+        off_t off = 0;
+        while ((r = pread(c->spill, chunk, sizeof chunk, off)) > 0) {
+            write_all_fd(STDOUT_FILENO, chunk, (size_t)r);
+            off += r;
+        }
+        close(c->spill);
+        c->spill = -1;
+    }
+}
+
+// Ordered: writes out finished captures up to the first running one
+static void capture_advance(void) {
+    while (g_cap_head < g_ncaps) {
+        struct capture *c = g_caps[g_cap_head];
+        capture_flush(c);
+        if (c->open)
+            return; // streams directly from here on
+        g_cap_head++;
+    }
+}
+
+// Lines: writes out `n` bytes of one line with its prefix
+static void capture_emit_line(struct capture *c, const char *line, size_t n) {
+    char prefix[32];
+    int plen = snprintf(prefix, sizeof prefix, "[%zu] ", c->seg);
+    struct iovec iov[3] = {
+        { prefix, (size_t)plen },
+        { (void *)line, n },
+        { "\n", line[n - 1] == '\n' ? 0 : 1 },
+    };
+    // one write per line, so prefixed lines from different segments don't mix
+    while (writev(STDOUT_FILENO, iov, 3) < 0 && errno == EINTR) {
+    }
+}
+
+static void capture_feed(struct capture *c, const char *data, size_t n) {
+    if (n == 0)
+        return;
+
+    if (g_capture == CAPTURE_LINES) {
+        // complete lines go out now; the unterminated tail waits for more
+        const char *nl;
+        while (n > 0 && (nl = memchr(data, '\n', n))) {
+            size_t k = (size_t)(nl - data) + 1;
+            if (c->len) {
+                capture_hold(c, data, k);
+                capture_emit_line(c, c->buf, c->len);
+                c->len = 0;
+            } else {
+                capture_emit_line(c, data, k);
+            }
+            data += k;
+            n -= k;
+        }
+        if (n > 0)
+            capture_hold(c, data, n);
+        if (c->len >= g_capture_cap) {
+            capture_emit_line(c, c->buf, c->len); // overlong line: split it
+            c->len = 0;
+        }
+        return;
+    }
+
+    // ordered: the head segment streams, everyone else is held back
+    if (g_caps[g_cap_head] == c) {
+        write_all_fd(STDOUT_FILENO, data, n);
+        return;
+    }
+    if (c->spill < 0 && c->len + n <= g_capture_cap) {
+        capture_hold(c, data, n);
+        return;
+    }
+    if (c->spill < 0 && (c->spill = capture_tmpfile()) < 0) {
+        capture_hold(c, data, n); // no disk to spill to: keep it in memory
+        return;
+    }
+    write_all_fd(c->spill, data, n);
+}
+
+static void capture_close(struct capture *c) {
+    if (c->src.fd >= 0) {
+        ev_del(&c->src);
+        close(c->src.fd);
+        c->src.fd = -1;
+    }
+    c->open = 0;
+    g_cap_open--;
+
+    if (g_capture == CAPTURE_LINES) {
+        if (c->len)
+            capture_emit_line(c, c->buf, c->len);
+        c->len = 0;
+    } else {
+        capture_advance();
+    }
+}
+
+static void ev_on_capture(struct ev_source *src, uint32_t events) {
+    (void)events;
+    struct capture *c = (struct capture *)src;
+    char chunk[65536];
+
+    for (;;) {
+        ssize_t r = read(src->fd, chunk, sizeof chunk);
+        if (r > 0) {
+            capture_feed(c, chunk, (size_t)r);
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN)
+            return;
+        capture_close(c); // EOF (or a broken pipe)
+        return;
+    }
+}
+
+/*
+ * capture_begin():
+ * Opens a capture for the next segment. Returns the (O_CLOEXEC) write
+ * end for its children, which the caller closes once they are started,
+ * or -1 to let this segment write directly.
+ */
+static int capture_begin(void) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) != 0)
+        return -1;
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+
+    struct capture *c = capture_new();
+    c->open = 1;
+    g_cap_open++;
+    ev_add(&c->src, p[0], EPOLLIN);
+    return p[1];
+}
+
+// Opens a capture with no pipe, which the shell feeds itself (a remote
+// segment's output frames) and ends with capture_close()
+static struct capture *capture_open(void) {
+    struct capture *c = capture_new();
+    c->open = 1;
+    g_cap_open++;
+    return c;
+}
+
+// Scratch fd an in-shell utility writes to instead of stdout
+static int capture_util_fd(void) {
+    if (g_cap_memfd < 0)
+        g_cap_memfd = memfd_create("wish-capture", MFD_CLOEXEC);
+    if (g_cap_memfd < 0)
+        return STDOUT_FILENO;
+    return g_cap_memfd;
+}
+
+// Takes what an in-shell utility wrote to capture_util_fd() as its segment's output
+static void capture_util_done(int fd) {
+    if (fd != g_cap_memfd)
+        return;
+
+    struct capture *c = capture_new();
+    char chunk[65536];
+    ssize_t r;
+    off_t off = 0;
+    while ((r = pread(fd, chunk, sizeof chunk, off)) > 0) {
+        capture_feed(c, chunk, (size_t)r);
+        off += r;
+    }
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        g_cap_memfd = -1;
+    }
+
+    if (g_capture == CAPTURE_LINES) {
+        if (c->len)
+            capture_emit_line(c, c->buf, c->len);
+        c->len = 0;
+    } else {
+        capture_advance();
+    }
+}
+
+/*
+ * capture_finish():
+ * End of a line: waits for the remaining pipes to close and writes out
+ * whatever is still held.
+ */
+static void capture_finish(void) {
+    while (g_cap_open > 0)
+        ev_run(-1);
+    if (g_capture == CAPTURE_ORDERED)
+        capture_advance();
+    g_ncaps = 0;
+    g_cap_head = 0;
+}
+
+static void capture_free(void) {
+    for (size_t i = 0; i < g_caps_cap; i++) {
+        if (g_caps[i]->spill >= 0)
+            close(g_caps[i]->spill);
+        free(g_caps[i]->buf);
+        free(g_caps[i]);
+    }
+    free(g_caps);
+    g_caps = NULL;
+    g_ncaps = g_caps_cap = 0;
+    if (g_cap_memfd >= 0)
+        close(g_cap_memfd);
+    g_cap_memfd = -1;
+}
+
+/* ===========================================================
+   ==========     REMOTE EXECUTION (SHELL SIDE)      ==========
+   =========================================================== */
+
+/*
+ * --spawn=remote sends each external segment to one of a pool of
+ * `wish --agent` processes instead of starting it here. --remote=FILE
+ * lists one agent per line as the command that reaches it, e.g.
+ *
+ *   ssh -T node1 /usr/local/bin/wish --agent
+ *   ssh -T node2 /usr/local/bin/wish --agent
+ *
+ * Each command is started once and talks over its stdin/stdout, so a
+ * node costs one long-lived connection that carries many segments at
+ * once. A segment goes to the agent with the fewest segments in flight
+ * per CPU. It runs there in the shell's cwd with the shell's path, so
+ * the nodes are expected to share the filesystem layout. Its stdout
+ * and stderr stream back (stdout into the '>' file here, if there is
+ * one, and through --capture like a local segment's otherwise), and its
+ * exit status completes a job in the local job table, so a line still
+ * ends only when every remote segment has. The agents are
+ * assumed to be built from the same source for the same architecture
+ * (frames are sent in host byte order).
+ */
+enum {
+    RF_HELLO = 1, // agent -> shell: u32 CPU count
+    RF_RUN   = 2, // shell -> agent: a segment (see remote_run())
+    RF_OUT   = 3, // agent -> shell: stdout bytes
+    RF_ERR   = 4, // agent -> shell: stderr bytes
+    RF_EXIT  = 5, // agent -> shell: struct rexit
+};
+
+struct rframe {
+    uint32_t type;
+    uint32_t id;  // segment
+    uint32_t len; // payload bytes that follow
+};
+
+struct rexit {
+    int32_t status;    // wait status of the last stage
+    int32_t failed;    // couldn't be started (bad name, cwd missing, ...)
+    int64_t user_us;   // all stages together
+    int64_t sys_us;
+    int64_t maxrss_kb;
+};
+
+struct remote {
+    struct ev_source src; // the connection (first, so src is the remote)
+    pid_t pid;            // the command that reaches the agent
+    char *buf;            // received bytes not yet handled
+    size_t len, cap;
+    size_t inflight;
+    uint32_t ncpu;
+};
+
+// One segment running remotely
+struct rjob {
+    uint32_t id;
+    pid_t pid;       // stand-in pid in the job table (negative)
+    struct remote *r;
+    char *redir;     // '>' target, opened on first output or success
+    int append;      // ... with '>>'
+    int out_fd;      // where stdout goes once known, or -1
+    struct capture *cap; // --capture: takes stderr, and stdout without '>'
+};
+
+static const char *g_remote_file = NULL; // --remote
+static int g_agent = 0;                  // --agent
+static struct remote *g_remotes = NULL;
+static size_t g_nremotes = 0;
+static size_t g_remote_rr = 0;          // where the least-loaded search starts
+static struct rjob *g_rjobs = NULL;
+static size_t g_nrjobs = 0, g_rjobs_cap = 0;
+static uint32_t g_rjob_next = 0;
+
+static void ev_on_remote(struct ev_source *src, uint32_t events);
+
+static struct rjob *rjob_find(uint32_t id, size_t *idx) {
+    for (size_t i = 0; i < g_nrjobs; i++) {
+        if (g_rjobs[i].id == id) {
+            if (idx)
+                *idx = i;
+            return &g_rjobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Finishes a remote segment in the job table and forgets it
+static void rjob_finish(size_t idx, int status, const struct rusage *ru) {
+    struct rjob *rj = &g_rjobs[idx];
+    if (rj->out_fd >= 0 && rj->out_fd != STDOUT_FILENO)
+        close(rj->out_fd);
+    if (rj->cap)
+        capture_close(rj->cap);
+    free(rj->redir);
+    rj->r->inflight--;
+    pid_t pid = rj->pid;
+    g_rjobs[idx] = g_rjobs[--g_nrjobs];
+    job_done(pid, status, ru);
+}
+
+// Where the segment's stdout goes: the '>' file (created now) or ours
+static int rjob_out(struct rjob *rj) {
+    if (rj->out_fd >= 0)
+        return rj->out_fd;
+    if (!rj->redir)
+        return rj->out_fd = STDOUT_FILENO;
+    rj->out_fd = open(rj->redir, O_CREAT|O_WRONLY|(rj->append ? O_APPEND : O_TRUNC)|O_CLOEXEC, 0666);
+    if (rj->out_fd < 0)
+        err();
+    return rj->out_fd;
+}
+
+// The connection is gone: everything still running on it has failed
+static void remote_lost(struct remote *r) {
+    if (r->src.fd < 0)
+        return;
+    ev_del(&r->src);
+    close(r->src.fd);
+    r->src.fd = -1;
+    r->len = 0;
+
+    struct rusage ru = { 0 };
+    for (size_t i = g_nrjobs; i-- > 0; ) {
+        if (g_rjobs[i].r == r) {
+            err();
+            rjob_finish(i, 1 << 8, &ru);
+        }
+    }
+}
+
+static void remote_frame(struct remote *r, const struct rframe *fr, const char *data) {
+    size_t idx;
+    struct rjob *rj = fr->type == RF_HELLO ? NULL : rjob_find(fr->id, &idx);
+
+    if (fr->type == RF_HELLO && fr->len >= sizeof(uint32_t)) {
+        memcpy(&r->ncpu, data, sizeof r->ncpu);
+        if (r->ncpu == 0)
+            r->ncpu = 1;
+    } else if (!rj) {
+        return; // not ours (any more)
+    } else if (fr->type == RF_OUT && rj->cap && !rj->redir) {
+        capture_feed(rj->cap, data, fr->len);
+    } else if (fr->type == RF_OUT) {
+        int fd = rjob_out(rj);
+        if (fd >= 0)
+            write_all_fd(fd, data, fr->len);
+    } else if (fr->type == RF_ERR && rj->cap) {
+        capture_feed(rj->cap, data, fr->len);
+    } else if (fr->type == RF_ERR) {
+        write_all_fd(STDERR_FILENO, data, fr->len);
+    } else if (fr->type == RF_EXIT && fr->len >= sizeof(struct rexit)) {
+        struct rexit ex;
+        memcpy(&ex, data, sizeof ex);
+        struct rusage ru = { 0 };
+        ru.ru_utime.tv_sec = ex.user_us / 1000000;
+        ru.ru_utime.tv_usec = ex.user_us % 1000000;
+        ru.ru_stime.tv_sec = ex.sys_us / 1000000;
+        ru.ru_stime.tv_usec = ex.sys_us % 1000000;
+        ru.ru_maxrss = (long)ex.maxrss_kb;
+        if (ex.failed)
+            err();
+        else
+            rjob_out(rj); // '>' creates the file even with no output
+        rjob_finish(idx, ex.status, &ru);
+    }
+}
+
+// Reads what the agent sent and handles every complete frame
+static void remote_read(struct remote *r) {
+    for (;;) {
+        if (r->cap - r->len < 65536) {
+            r->cap = r->cap ? r->cap * 2 : 131072;
+            r->buf = realloc(r->buf, r->cap);
+            if (!r->buf) { err(); exit(1); }
+        }
+        ssize_t got = read(r->src.fd, r->buf + r->len, r->cap - r->len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && errno == EAGAIN)
+            break;
+        if (got <= 0) {
+            remote_lost(r);
+            return;
+        }
+        r->len += (size_t)got;
+    }
+
+    size_t off = 0;
+    while (r->len - off >= sizeof(struct rframe)) {
+        struct rframe fr;
+        memcpy(&fr, r->buf + off, sizeof fr);
+        if (r->len - off - sizeof fr < fr.len)
+            break;
+        remote_frame(r, &fr, r->buf + off + sizeof fr);
+        if (r->src.fd < 0)
+            return;
+        off += sizeof fr + fr.len;
+    }
+    memmove(r->buf, r->buf + off, r->len - off);
+    r->len -= off;
+}
+
+static void ev_on_remote(struct ev_source *src, uint32_t events) {
+    (void)events;
+    remote_read((struct remote *)src);
+}
+
+// Sends all of buf, reading whatever the agent sends meanwhile so that
+// neither side can block the other. Returns -1 if the connection died.
+static int remote_send(struct remote *r, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        if (r->src.fd < 0)
+            return -1;
+        ssize_t w = send(r->src.fd, p, n, MSG_NOSIGNAL);
+        if (w > 0) {
+            p += w;
+            n -= (size_t)w;
+            continue;
+        }
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && errno != EAGAIN) {
+            remote_lost(r);
+            return -1;
+        }
+        struct pollfd pf = { r->src.fd, POLLIN | POLLOUT, 0 };
+        if (poll(&pf, 1, -1) > 0 && (pf.revents & (POLLIN | POLLHUP | POLLERR)))
+            remote_read(r);
+    }
+    return 0;
+}
+
+// The agent with the fewest segments per CPU, or NULL if none is left
+static struct remote *remote_pick(void) {
+    struct remote *best = NULL;
+    for (size_t k = 0; k < g_nremotes; k++) {
+        struct remote *r = &g_remotes[(g_remote_rr + k) % g_nremotes];
+        if (r->src.fd < 0)
+            continue;
+        if (!best || (uint64_t)r->inflight * best->ncpu < (uint64_t)best->inflight * r->ncpu)
+            best = r;
+    }
+    g_remote_rr++;
+    return best;
+}
+
+/*
+ * remote_run():
+ * Sends one segment to an agent and adds it to the job table as a
+ * single job. Returns 1 if it was sent, -1 on error.
+ *
+ * RUN payload: u32 nstages, u32 npath, u32 has_redir, u32 argc per
+ * stage, then NUL-terminated strings: cwd, the path entries, and every
+ * stage's argv.
+ */
+static int remote_run(struct command *cmd) {
+    // agents only get argv; their first stage reads /dev/null
+    if (cmd->input || cmd->here) {
+        err();
+        return -1;
+    }
+
+    struct remote *r = remote_pick();
+    char *cwd = getcwd(NULL, 0);
+    if (!r || !cwd) {
+        free(cwd);
+        err();
+        return -1;
+    }
+
+    uint32_t npath = 0;
+    while (g_path && g_path[npath])
+        npath++;
+    size_t hdr = (3 + cmd->nstages) * sizeof(uint32_t);
+    size_t len = hdr + strlen(cwd) + 1;
+    for (uint32_t i = 0; i < npath; i++)
+        len += strlen(g_path[i]) + 1;
+    for (size_t i = 0; i < cmd->nstages; i++) {
+        for (char **a = cmd->stages[i]; *a; a++)
+            len += strlen(*a) + 1;
+    }
+
+    struct rframe fr = { RF_RUN, ++g_rjob_next, (uint32_t)len };
+    char *msg = arena_alloc(&g_line_arena, sizeof fr + len);
+    uint32_t *w = (uint32_t *)(msg + sizeof fr);
+    memcpy(msg, &fr, sizeof fr);
+    w[0] = (uint32_t)cmd->nstages;
+    w[1] = npath;
+    w[2] = cmd->redir != NULL;
+    char *p = msg + sizeof fr + hdr;
+    p = stpcpy(p, cwd) + 1;
+    for (uint32_t i = 0; i < npath; i++)
+        p = stpcpy(p, g_path[i]) + 1;
+    for (size_t i = 0; i < cmd->nstages; i++) {
+        uint32_t argc = 0;
+        for (char **a = cmd->stages[i]; *a; a++, argc++)
+            p = stpcpy(p, *a) + 1;
+        w[3 + i] = argc;
+    }
+    free(cwd);
+
+    uint64_t t0 = now_ns();
+    if (remote_send(r, msg, sizeof fr + len) != 0) {
+        err();
+        return -1;
+    }
+    g_stats.spawn_ns += now_ns() - t0;
+
+    if (g_nrjobs == g_rjobs_cap) {
+        g_rjobs_cap = g_rjobs_cap ? g_rjobs_cap * 2 : 64;
+        g_rjobs = realloc(g_rjobs, g_rjobs_cap * sizeof *g_rjobs);
+        if (!g_rjobs) { err(); exit(1); }
+    }
+    struct rjob *rj = &g_rjobs[g_nrjobs++];
+    rj->id = fr.id;
+    rj->pid = -(pid_t)(fr.id & 0x3fffffff) - 1;
+    rj->r = r;
+    rj->redir = cmd->redir ? strdup(cmd->redir) : NULL;
+    rj->append = cmd->append;
+    rj->out_fd = -1;
+    if (cmd->redir && !rj->redir) { err(); exit(1); }
+    // captured like run_external()'s segments
+    rj->cap = g_capture && !(cmd->nstages == 1 && cmd->redir) ? capture_open() : NULL;
+    r->inflight++;
+    job_add(rj->pid, cmd->stages[cmd->nstages - 1], t0);
+    return 1;
+}
+
+// Starts the agent command on one line of the --remote file
+static int remote_connect(struct remote *r, char *line) {
+    char *argv[64];
+    size_t argc = 0;
+    for (char *tok = strtok(line, " \t"); tok && argc < 63; tok = strtok(NULL, " \t"))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+    if (argc == 0)
+        return -1;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        return -1;
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, sv[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, sv[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &g_child_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    int rc = posix_spawnp(&r->pid, argv[0], &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(sv[1]);
+    if (rc != 0) {
+        close(sv[0]);
+        return -1;
+    }
+
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    r->ncpu = 1; // until its HELLO arrives
+    ev_add(&r->src, sv[0], EPOLLIN);
+    return 0;
+}
+
+// Connects to every agent in g_remote_file; returns -1 if none came up
+static int remote_start(void) {
+    FILE *f = fopen(g_remote_file, "r");
+    if (!f)
+        return -1;
+
+    char **lines = NULL;
+    char *line = NULL;
+    size_t cap = 0, n = 0, alloc = 0;
+    while (getline(&line, &cap, f) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *s = line + strspn(line, " \t");
+        if (!*s || *s == '#')
+            continue;
+
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 8;
+            lines = realloc(lines, alloc * sizeof *lines);
+            if (!lines) { err(); exit(1); }
+        }
+        lines[n] = strdup(s);
+        if (!lines[n]) { err(); exit(1); }
+        n++;
+    }
+    free(line);
+    fclose(f);
+
+    // sized once: registered ev_sources must not move
+    g_remotes = calloc(n ? n : 1, sizeof *g_remotes);
+    if (!g_remotes) { err(); exit(1); }
+    g_nremotes = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct remote *r = &g_remotes[g_nremotes];
+        r->src.fd = -1;
+        r->src.ready = ev_on_remote;
+        if (remote_connect(r, lines[i]) == 0)
+            g_nremotes++;
+        free(lines[i]);
+    }
+    free(lines);
+    return g_nremotes ? 0 : -1;
+}
+
+// Hangs up on the agents (they finish what they have and exit)
+static void remote_stop(void) {
+    for (size_t i = 0; i < g_nremotes; i++) {
+        struct remote *r = &g_remotes[i];
+        if (r->src.fd >= 0)
+            close(r->src.fd);
+        free(r->buf);
+    }
+    for (size_t i = 0; i < g_nrjobs; i++)
+        free(g_rjobs[i].redir);
+    free(g_remotes);
+    free(g_rjobs);
+    g_remotes = NULL;
+    g_rjobs = NULL;
+    g_nremotes = g_nrjobs = g_rjobs_cap = 0;
+}
+
+/* ===========================================================
+   ==========        BUILT-IN COMMAND HANDLER         =========
+   =========================================================== */
+
+/*
+ * Each builtin gets argv (argv[0] is its own name) and runs inside the
+ * shell, no forking. Argument errors are reported with err().
+ */
+
+// The segment whose builtin is running, for its redirections (most ignore them)
+static const struct command *g_builtin_cmd = NULL;
+
+static void lookahead_free(void);
+static void incr_declare(char **files);
+static void incr_save(void);
+static void run_repeat(char **argv, size_t n, int parallel, const struct command *seg);
+static void source_run(const char *path);
+static void source_free(void);
+
+// Releases shell-wide state before exiting (and prints --stats)
+static void shell_shutdown(void) {
+    capture_finish(); // `exit` mid-line still passes on earlier output
+    trace_flush();
+    incr_save(); // before stats, which can die of SIGPIPE on a closed stderr
+    if (g_pool_slot)
+        *g_pool_slot = g_stats; // the pool prints the totals
+    else if (g_stats_at_exit)
+        stats_print(stderr);
+    path_free();
+    hash_free();
+    pathidx_free();
+    capture_free();
+    aff_clear();
+    lookahead_free();
+    source_free();
+    remote_stop();
+    cgroup_stop();
+    pressure_stop();
+    arena_free(&g_line_arena);
+    jobs_free();
+    bg_free();
+    ev_free();
+    zygote_stop();
+}
+
+// What the shell exits with when it's done: 0, except that a -P worker
+// whose script reported errors says so to the pool
+static int exit_status(void) {
+    return g_pool_slot && g_errors ? 1 : 0;
+}
+
+// ======= exit =======
+static void builtin_exit(char **argv) {
+    if (argv[1] != NULL) {
+        err(); 
+        return; // exit takes no args
+    }
+    shell_shutdown();
+    exit(exit_status()); // ends the shell
+}
+
+// ======= cd =======
+static void builtin_cd(char **argv) {
+    if (!argv[1] || argv[2]) { // exactly one arg
+        err(); 
+        return; 
+    }
+    if (chdir(argv[1]) != 0) {
+        err();
+        return;
+    }
+    zygote_note_cwd();
+
+    // relative PATH entries now point somewhere else
+    for (size_t i = 0; g_path && g_path[i]; i++) {
+        if (g_path[i][0] != '/') {
+            hash_flush();
+            break;
+        }
+    }
+}
+
+// ======= path =======
+static void builtin_path(char **argv) {
+    // clear old path (and everything resolved against it)
+    path_free();
+    hash_flush();
+
+    // count new dirs (can be zero → disables externals)
+    size_t count = 0;
+    while (argv[1 + count]) 
+        count++;
+
+    g_path = malloc((count + 1) * sizeof(char*));
+    if (!g_path) { 
+        err(); 
+        exit(1); 
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        g_path[i] = strdup(argv[1 + i]);
+        if (!g_path[i]) { 
+            err(); 
+            exit(1); 
+        }
+    }
+    g_path[count] = NULL;
+    pathidx_rebuild();
+}
+
+// ======= hash =======
+// "hash" lists cached command locations, "hash -r" forgets them (and
+// rescans the PATH directories)
+static void builtin_hash(char **argv) {
+    if (argv[1]) {
+        if (strcmp(argv[1], "-r") != 0 || argv[2]) {
+            err();
+            return;
+        }
+        hash_flush();
+        pathidx_rebuild();
+        return;
+    }
+
+    for (size_t i = 0; i < g_hash_cap; i++) {
+        for (struct hash_entry *e = g_hash[i]; e; e = e->next)
+            printf("%lu\t%s\n", e->hits, e->path);
+    }
+    fflush(stdout);
+}
+
+// ======= maxjobs =======
+// "maxjobs" prints the parallelism limit, "maxjobs N" sets it (0 = unlimited)
+static void builtin_maxjobs(char **argv) {
+    if (!argv[1]) {
+        printf("%zu\n", g_max_jobs);
+        fflush(stdout);
+        return;
+    }
+    size_t n;
+    if (argv[2] || parse_count(argv[1], &n) != 0) {
+        err();
+        return;
+    }
+    g_max_jobs = n;
+}
+
+// ======= affinity =======
+// "affinity" prints the CPU placement policy; "affinity off | CPULIST |
+// numa [NODELIST]" sets it for the children started from now on
+static void builtin_affinity(char **argv) {
+    if (!argv[1]) {
+        printf("%s\n", g_aff_spec ? g_aff_spec : "off");
+        fflush(stdout);
+        return;
+    }
+    if ((argv[2] && argv[3]) || affinity_set(argv[1], argv[2]) != 0)
+        err();
+}
+
+// ======= deps =======
+// "deps FILE..." names files the next line reads and lets --incremental
+// skip it even without a '>' (a no-op otherwise)
+static void builtin_deps(char **argv) {
+    incr_declare(argv + 1);
+}
+
+// ======= repeat =======
+// "repeat [-p] N CMD [ARGS...]" runs CMD N times, one after another or
+// (-p) all at once; redirections on the line apply to every copy
+static void builtin_repeat(char **argv) {
+    int parallel = argv[1] && strcmp(argv[1], "-p") == 0;
+    char **rest = argv + 1 + parallel;
+    size_t n;
+    if (!rest[0] || !rest[1] || parse_count(rest[0], &n) != 0) {
+        err();
+        return;
+    }
+    run_repeat(rest + 1, n, parallel, g_builtin_cmd);
+}
+
+// ======= jobs =======
+// "jobs" lists the background jobs (finished ones for the last time)
+static void builtin_jobs(char **argv) {
+    if (argv[1]) {
+        err();
+        return;
+    }
+    bg_report(1);
+}
+
+// ======= source =======
+// "source FILE" runs FILE's lines here, parsed once and cached
+static void builtin_source(char **argv) {
+    if (!argv[1] || argv[2]) {
+        err();
+        return;
+    }
+    source_run(argv[1]);
+}
+
+// ======= wait =======
+// "wait" blocks until every background job is done, "wait N" until job N is
+static void builtin_wait(char **argv) {
+    if (!argv[1]) {
+        while (g_bg_running > 0)
+            ev_run(-1);
+        return;
+    }
+    size_t id;
+    if (argv[2] || parse_count(argv[1], &id) != 0) {
+        err();
+        return;
+    }
+    for (size_t i = 0; i < g_nbg; i++) {
+        if (g_bg[i].id == id) {
+            while (g_bg[i].running > 0)
+                ev_run(-1);
+            return;
+        }
+    }
+    err(); // no such job
+}
+
+// ======= stats =======
+// "stats" prints resource accounting so far, "stats -r" zeroes it
+static void builtin_stats(char **argv) {
+    if (argv[1]) {
+        if (strcmp(argv[1], "-r") != 0 || argv[2]) {
+            err();
+            return;
+        }
+        memset(&g_stats, 0, sizeof g_stats);
+        return;
+    }
+    stats_print(stdout);
+}
+
+/* -------- in-shell utilities -------- */
+
+/*
+ * With --inline, the hottest trivial programs (echo, true, false, pwd)
+ * run inside the shell instead of costing a fork+exec each. They mirror
+ * the coreutils behaviour and only kick in for a single-stage segment
+ * whose name also resolves in the PATH, so `path` still decides what can
+ * run. Anything they don't handle (--help, odd pwd arguments) falls back
+ * to the real binary. Output goes to `fd`; each returns an exit status.
+ */
+static int g_inline = 0;
+
+static int is_help_or_version(char **argv) {
+    return argv[1] && !argv[2] &&
+           (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "--version") == 0);
+}
+
+// Appends one "-e" escape starting at *pp (just past the backslash).
+// Returns 1 when it was \c, which ends all output.
+static int echo_escape(const char **pp, char **outp) {
+    const char *p = *pp;
+    char *o = *outp;
+    int v, k;
+
+    switch (*p) {
+    case 'a': *o++ = '\a'; p++; break;
+    case 'b': *o++ = '\b'; p++; break;
+    case 'c': return 1;
+    case 'e': *o++ = 0x1b; p++; break;
+    case 'f': *o++ = '\f'; p++; break;
+    case 'n': *o++ = '\n'; p++; break;
+    case 'r': *o++ = '\r'; p++; break;
+    case 't': *o++ = '\t'; p++; break;
+    case 'v': *o++ = '\v'; p++; break;
+    case '\\': *o++ = '\\'; p++; break;
+    case '0':
+        p++;
+        for (v = 0, k = 0; k < 3 && *p >= '0' && *p <= '7'; k++)
+            v = v * 8 + (*p++ - '0');
+        *o++ = (char)v;
+        break;
+    case 'x':
+        if (!isxdigit((unsigned char)p[1])) {
+            *o++ = '\\';
+            break;
+        }
+        p++;
+        for (v = 0, k = 0; k < 2 && isxdigit((unsigned char)*p); k++, p++)
+            v = v * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+        *o++ = (char)v;
+        break;
+    default:
+        // not an escape: keep the backslash (and let the char print normally)
+        *o++ = '\\';
+        break;
+    }
+    *pp = p;
+    *outp = o;
+    return 0;
+}
+
+static int util_echo(char **argv, int fd) {
+    int newline = 1, escapes = 0;
+    size_t i = 1;
+
+    // leading -n / -e / -E (or combinations like -ne) are options
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        const char *o = argv[i] + 1;
+        if (strspn(o, "neE") != strlen(o))
+            break;
+        for (; *o; o++) {
+            if (*o == 'n') newline = 0;
+            else if (*o == 'e') escapes = 1;
+            else escapes = 0;
+        }
+    }
+
+    size_t len = 2;
+    for (size_t k = i; argv[k]; k++)
+        len += strlen(argv[k]) + 1;
+
+    // escapes never make the output longer than the input
+    char *buf = arena_alloc(&g_line_arena, len);
+    char *o = buf;
+    for (size_t k = i; argv[k]; k++) {
+        if (k > i)
+            *o++ = ' ';
+        const char *p = argv[k];
+        if (!escapes) {
+            o = stpcpy(o, p);
+            continue;
+        }
+        while (*p) {
+            if (*p != '\\' || !p[1]) {
+                *o++ = *p++;
+                continue;
+            }
+            p++;
+            if (echo_escape(&p, &o))
+                return write_all_fd(fd, buf, (size_t)(o - buf)) ? 1 : 0;
+        }
+    }
+    if (newline)
+        *o++ = '\n';
+    return write_all_fd(fd, buf, (size_t)(o - buf)) ? 1 : 0;
+}
+
+static int util_true(char **argv, int fd) {
+    (void)argv;
+    (void)fd;
+    return 0;
+}
+
+static int util_false(char **argv, int fd) {
+    (void)argv;
+    (void)fd;
+    return 1;
+}
+
+static int util_pwd(char **argv, int fd) {
+    (void)argv;
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        return 1;
+    size_t n = strlen(cwd);
+    cwd[n] = '\n';
+    int rc = write_all_fd(fd, cwd, n + 1) ? 1 : 0;
+    free(cwd);
+    return rc;
+}
+
+// Says whether the utility can do this call itself
+static int util_handles(int (*util)(char **, int), char **argv) {
+    if (is_help_or_version(argv))
+        return 0;
+    if (util == util_pwd) {
+        // plain pwd, or only -P flags (the coreutils default)
+        for (size_t i = 1; argv[i]; i++) {
+            if (strcmp(argv[i], "-P") != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * The builtin registry. Adding a builtin means adding a row here.
+ */
+struct builtin {
+    const char *name;
+    void (*run)(char **argv);         // shell builtin, or NULL
+    int (*util)(char **argv, int fd); // in-shell utility (--inline), or NULL
+};
+
+static const struct builtin g_builtins[] = {
+    { "exit",     builtin_exit,     NULL },
+    { "cd",       builtin_cd,       NULL },
+    { "path",     builtin_path,     NULL },
+    { "hash",     builtin_hash,     NULL },
+    { "maxjobs",  builtin_maxjobs,  NULL },
+    { "stats",    builtin_stats,    NULL },
+    { "affinity", builtin_affinity, NULL },
+    { "deps",     builtin_deps,     NULL },
+    { "repeat",   builtin_repeat,   NULL },
+    { "jobs",     builtin_jobs,     NULL },
+    { "wait",     builtin_wait,     NULL },
+    { "source",   builtin_source,   NULL },
+    { "echo",     NULL,             util_echo },
+    { "true",     NULL,             util_true },
+    { "false",    NULL,             util_false },
+    { "pwd",      NULL,             util_pwd },
+};
+
+#define NBUILTINS (sizeof g_builtins / sizeof g_builtins[0])
+
+/*
+ * Lookup index, filled by builtin_init(). Names are keyed on
+ * (length, first char, last char) into a small open-addressing table,
+ * so a non-builtin is usually rejected after one slot and never costs
+ * more than a strnlen() bounded by the longest builtin name.
+ */
+#define BUILTIN_SLOTS 64 // power of two, well over 2 * NBUILTINS
+
+static unsigned char g_builtin_slot[BUILTIN_SLOTS]; // index + 1 (0 = empty)
+static size_t g_builtin_maxlen = 0;
+
+static size_t builtin_key(const char *name, size_t len) {
+    return (len * 7 + (unsigned char)name[0] * 3 + (unsigned char)name[len - 1])
+           & (BUILTIN_SLOTS - 1);
+}
+
+static void builtin_init(void) {
+    for (size_t i = 0; i < NBUILTINS; i++) {
+        size_t len = strlen(g_builtins[i].name);
+        if (len > g_builtin_maxlen)
+            g_builtin_maxlen = len;
+
+        size_t b = builtin_key(g_builtins[i].name, len);
+        while (g_builtin_slot[b])
+            b = (b + 1) & (BUILTIN_SLOTS - 1);
+        g_builtin_slot[b] = (unsigned char)(i + 1);
+    }
+}
+
+static const struct builtin *builtin_find(const char *name) {
+    size_t len = strnlen(name, g_builtin_maxlen + 1);
+    if (len == 0 || len > g_builtin_maxlen)
+        return NULL;
+
+    for (size_t b = builtin_key(name, len); g_builtin_slot[b]; b = (b + 1) & (BUILTIN_SLOTS - 1)) {
+        const struct builtin *bi = &g_builtins[g_builtin_slot[b] - 1];
+        if (strncmp(bi->name, name, len) == 0 && bi->name[len] == '\0')
+            return bi;
+    }
+    return NULL;
+}
+
+static char *find_prog(const char *name);
+
+/*
+ * run_util():
+ * Runs an in-shell utility with the usual '>' semantics: stdout and
+ * stderr go to redir_path (created / truncated, or appended to with
+ * `append`) if given. Otherwise --capture collects its output like a
+ * child's. None of them reads stdin, so '<' doesn't matter here.
+ */
+static void run_util(int (*util)(char **, int), char **argv, const char *redir_path,
+                     int append) {
+    uint64_t t0 = now_ns();
+    int fd = STDOUT_FILENO;
+    if (g_capture && !redir_path) {
+        fd = capture_util_fd();
+        job_util_done(argv, util(argv, fd), t0);
+        capture_util_done(fd);
+        return;
+    }
+    if (redir_path) {
+        fd = open(redir_path, O_CREAT|O_WRONLY|(append ? O_APPEND : O_TRUNC)|O_CLOEXEC, 0666);
+        if (fd < 0) {
+            err();
+            return;
+        }
+    }
+    job_util_done(argv, util(argv, fd), t0);
+    if (fd != STDOUT_FILENO)
+        close(fd);
+}
+
+/*
+ * util_in_path():
+ * Whether the real program behind in-shell utility `bi` is in the PATH.
+ * A hit is remembered until the resolve cache or the PATH index next
+ * loses something (g_hash_gen), so a hot `echo` costs no lookup at all.
+ */
+static int util_in_path(const struct builtin *bi) {
+    static unsigned long found[NBUILTINS]; // g_hash_gen + 1 when last found
+    size_t k = (size_t)(bi - g_builtins);
+    if (found[k] == g_hash_gen + 1)
+        return 1;
+
+    char *prog = find_prog(bi->name);
+    if (!prog)
+        return 0;
+    free(prog);
+    found[k] = g_hash_gen + 1;
+    return 1;
+}
+
+/*
+ * handle_builtin():
+ * Checks if argv[0] is registered in g_builtins and runs it. In-shell
+ * utilities only count when --inline is on and the real program exists
+ * in the PATH. `cmd` is the (single-stage) segment.
+ * Returns 1 if handled, 0 otherwise.
+ */
+static int handle_builtin(const struct command *cmd) {
+    char **argv = cmd->stages[0];
+    if (!argv || !argv[0]) 
+        return 0;
+
+    const struct builtin *bi = builtin_find(argv[0]);
+    if (!bi)
+        return 0; // not a built-in
+
+    if (bi->run) {
+        g_builtin_cmd = cmd;
+        bi->run(argv);
+        g_builtin_cmd = NULL;
+        return 1;
+    }
+
+    if (!g_inline || !util_handles(bi->util, argv) || !util_in_path(bi))
+        return 0; // let run_external() run it or report it
+
+    run_util(bi->util, argv, cmd->redir, cmd->append);
+    return 1;
+}
+
+
+// ========== external command handler ==========
+
+/*
+ * Process creation backends. SPAWN_POSIX uses posix_spawn(), which glibc
+ * implements with clone(CLONE_VM|CLONE_VFORK), so the shell's page tables
+ * are never copied. SPAWN_FORK is the classic fork()+execv() path, kept as
+ * a fallback and for comparison. SPAWN_ZYGOTE hands the work to the fork
+ * server above. Picked with --spawn=posix|fork|zygote.
+ */
+enum spawn_backend {
+    SPAWN_POSIX,
+    SPAWN_FORK,
+    SPAWN_ZYGOTE,
+    SPAWN_REMOTE,
+};
+
+static enum spawn_backend g_spawn = SPAWN_POSIX;
+
+// spawn_fork():
+// fork() a child, wire up its stdin/stdout/stderr and the redirection
+// there, then execv(). in_fd/out_fd/err_fd are pipe ends, or -1 to
+// inherit ours.
+static pid_t spawn_fork(const char *prog, char **argv, int in_fd, int out_fd,
+                        int err_fd, const char *redir_path) {
+    pid_t pid = cg_fork(g_child_cg);
+    // if the fork fails, print error (unless it's worth retrying, see spawn_job())
+    if (pid < 0) {
+        if (errno != EAGAIN && errno != ENOMEM)
+            err();
+        return -1;
+    }
+
+    // now we are in the child process
+    if (pid == 0) {
+        // the shell blocks SIGCHLD for its signalfd; the program shouldn't inherit that
+        sigprocmask(SIG_SETMASK, &g_child_mask, NULL);
+        if (g_child_cpus)
+            sched_setaffinity(0, sizeof *g_child_cpus, g_child_cpus); // best effort
+
+        // pipeline plumbing (the pipe fds themselves are O_CLOEXEC)
+        if ((in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0) ||
+            (out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0) ||
+            (err_fd >= 0 && dup2(err_fd, STDERR_FILENO) < 0)) {
+            err();
+            _exit(1);
+        }
+
+        // if output redirection is needed
+        if (redir_path) {
+            // create the file (if it doesn't exist), open it for writing, and truncate if it already exists
+            int fd = open(redir_path, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+            
+            // if the file cannot be opened, print error and exit
+            if (fd < 0) { 
+                err(); 
+                _exit(1); 
+            }
+
+            // redirect stdout and stderr to file
+            if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
+                err();
+                _exit(1);
+            }
+
+            // close the original file descriptor
+            close(fd);
+        }
+
+        // replace the child process with the new program
+        execv(prog, argv);
+
+        // if the execv fails, print error and exit child
+        err();
+        _exit(1);
+    }
+
+    // return the child's PID to the caller
+    return pid;
+}
+
+// spawn_posix():
+// posix_spawn() with file actions standing in for the dup2()/open()
+// the fork path does in the child. Errors from the redirect or from
+// execv() come back as the return value, so they are reported here.
+static pid_t spawn_posix(const char *prog, char **argv, int in_fd, int out_fd,
+                         int err_fd, const char *redir_path) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_t *fap = NULL;
+
+    if (in_fd >= 0 || out_fd >= 0 || err_fd >= 0 || redir_path) {
+        if (posix_spawn_file_actions_init(&fa) != 0) {
+            err();
+            return -1;
+        }
+        fap = &fa;
+
+        int rc = 0;
+        if (in_fd >= 0)
+            rc |= posix_spawn_file_actions_adddup2(fap, in_fd, STDIN_FILENO);
+        if (out_fd >= 0)
+            rc |= posix_spawn_file_actions_adddup2(fap, out_fd, STDOUT_FILENO);
+        if (err_fd >= 0)
+            rc |= posix_spawn_file_actions_adddup2(fap, err_fd, STDERR_FILENO);
+
+        // stdout to the file (created / truncated), stderr joins it
+        if (redir_path) {
+            rc |= posix_spawn_file_actions_addopen(fap, STDOUT_FILENO, redir_path,
+                                                   O_CREAT|O_WRONLY|O_TRUNC, 0666);
+            rc |= posix_spawn_file_actions_adddup2(fap, STDOUT_FILENO, STDERR_FILENO);
+        }
+        if (rc != 0) {
+            posix_spawn_file_actions_destroy(fap);
+            err();
+            return -1;
+        }
+    }
+
+    // the shell blocks SIGCHLD for its signalfd; the program shouldn't inherit that
+    posix_spawnattr_t attr;
+    if (posix_spawnattr_init(&attr) != 0) {
+        if (fap)
+            posix_spawn_file_actions_destroy(fap);
+        err();
+        return -1;
+    }
+    posix_spawnattr_setsigmask(&attr, &g_child_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    // there's no spawn attribute for CPU affinity; the child inherits ours
+    int pinned = g_child_cpus &&
+                 sched_setaffinity(0, sizeof *g_child_cpus, g_child_cpus) == 0;
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, prog, fap, &attr, argv, environ);
+    if (pinned)
+        sched_setaffinity(0, sizeof g_aff_allowed, &g_aff_allowed);
+
+    posix_spawnattr_destroy(&attr);
+    if (fap)
+        posix_spawn_file_actions_destroy(fap);
+
+    if (rc != 0) {
+        errno = rc;
+        if (rc != EAGAIN && rc != ENOMEM)
+            err(); // spawn_job() retries those
+        return -1;
+    }
+    return pid;
+}
+
+// Starts one process with the selected backend
+static pid_t spawn_one(const char *prog, char **argv, int in_fd, int out_fd,
+                       int err_fd, const char *redir_path) {
+    if (g_spawn == SPAWN_ZYGOTE)
+        return zygote_spawn(prog, argv, in_fd, out_fd, err_fd, redir_path);
+    if (g_spawn == SPAWN_FORK || g_child_cg >= 0)
+        return spawn_fork(prog, argv, in_fd, out_fd, err_fd, redir_path);
+    return spawn_posix(prog, argv, in_fd, out_fd, err_fd, redir_path);
+}
+
+// A spawn failed for lack of resources: lower the throttling cap
+static void throttle_down(void) {
+    size_t cap = g_jobs_running ? g_jobs_running : 1;
+    if (!g_throttle_cap)
+        g_throttle_from = cap;
+    else if (cap >= g_throttle_cap)
+        cap = g_throttle_cap > 1 ? g_throttle_cap / 2 : 1;
+    g_throttle_cap = cap;
+    g_throttle_ok = 0;
+    if (!g_stats.min_cap || cap < g_stats.min_cap)
+        g_stats.min_cap = cap;
+}
+
+// A spawn went through: raise the cap again, slowly
+static void throttle_up(void) {
+    if (!g_throttle_cap || ++g_throttle_ok < THROTTLE_RECOVER)
+        return;
+    g_throttle_ok = 0;
+    g_throttle_cap++;
+    if (g_max_jobs ? g_throttle_cap >= g_max_jobs : g_throttle_cap >= 2 * g_throttle_from)
+        g_throttle_cap = 0;
+}
+
+// Waits out retry `attempt` of a failed spawn, reaping children meanwhile
+static void throttle_backoff(unsigned attempt) {
+    static uint64_t seed = 0;
+    if (!seed)
+        seed = now_ns() ^ ((uint64_t)getpid() << 32);
+    seed ^= seed << 13; // xorshift64
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+
+    uint64_t us = (uint64_t)THROTTLE_BASE_US << attempt;
+    if (us > THROTTLE_MAX_US)
+        us = THROTTLE_MAX_US;
+    us = us / 2 + seed % (us / 2 + 1); // jitter: [us/2, us]
+
+    // a child exiting frees what we're short of, so stop early for that
+    size_t running = g_jobs_running + g_bg_running;
+    uint64_t t0 = now_ns(), until = t0 + us * 1000;
+    for (uint64_t t = t0; t < until; t = now_ns()) {
+        if (running == 0) {
+            struct timespec ts = { 0, (long)(until - t) };
+            nanosleep(&ts, NULL);
+            break;
+        }
+        ev_run((int)((until - t + 999999) / 1000000));
+        if (g_jobs_running + g_bg_running < running)
+            break;
+    }
+    g_stats.backoff_ns += now_ns() - t0;
+}
+
+// spawn_job():
+// spawn_one(), timed and traced, with the child added to the job table
+// so we can wait for it later. Out of processes or memory, it backs
+// off and retries (see the throttling notes at the job table).
+// Returns its pid, or -1.
+static pid_t spawn_job(const char *prog, char **argv, int in_fd, int out_fd,
+                       int err_fd, const char *redir_path) {
+    uint64_t t0 = now_ns();
+    g_child_cpus = affinity_next();
+    int cg = cg_next();
+    g_child_cg = cg >= 0 ? g_cg[cg].fd : -1;
+    pid_t pid;
+    for (unsigned attempt = 0;; attempt++) {
+        errno = 0;
+        pid = spawn_one(prog, argv, in_fd, out_fd, err_fd, redir_path);
+        if (pid > 0 || (errno != EAGAIN && errno != ENOMEM))
+            break;
+        if (attempt == 0) {
+            g_stats.throttled++;
+            throttle_down();
+        }
+        if (attempt == SPAWN_RETRIES) {
+            g_stats.dropped++;
+            err();
+            break;
+        }
+        g_stats.retries++;
+        throttle_backoff(attempt);
+    }
+    if (pid > 0)
+        throttle_up();
+    uint64_t t1 = now_ns();
+    g_stats.spawn_ns += t1 - t0;
+    trace_rec(TR_SPAWN, t0, t1, 0, pid, argv[0]);
+    g_child_cg = -1;
+    if (pid > 0)
+        job_add(pid, argv, t0)->cg = cg;
+    else
+        cg_job_done(cg);
+    return pid;
+}
+
+// find_prog():
+// Works out which file to execv() for argv[0]. Explicit paths (with a
+// '/') are used as-is; anything else goes through the PATH search.
+// Returns a malloc'd path, or NULL if there is nothing to run.
+static char *find_prog(const char *name) {
+    // if the user provides a path (contains '/'), use it directly; otherwise search PATH
+    if (strchr(name, '/')) {
+        if (access(name, X_OK) != 0)
+            return NULL;
+        char *prog = strdup(name);
+        if (!prog) { err(); exit(1); }
+        return prog;
+    }
+
+    // search PATH and fail if not found
+    if (!g_path || !g_path[0])
+        return NULL;
+    return resolve_exec(name);
+}
+
+/*
+ * open_input():
+ * Opens what the first stage of `cmd` reads: the '<' file, or a memfd
+ * holding the '<<<' words (joined by spaces, plus a newline), so a
+ * here-string never touches the disk. Sets *fd, to -1 if there is
+ * neither. Returns -1 if it can't be opened.
+ */
+static int open_input(const struct command *cmd, int *fd) {
+    *fd = -1;
+    if (cmd->input) {
+        *fd = open(cmd->input, O_RDONLY | O_CLOEXEC);
+        return *fd < 0 ? -1 : 0;
+    }
+    if (!cmd->here)
+        return 0;
+
+    size_t len = 0;
+    for (char **w = cmd->here; *w; w++)
+        len += strlen(*w) + 1;
+    char *text = arena_alloc(&g_line_arena, len), *p = text;
+    for (char **w = cmd->here; *w; w++) {
+        p = stpcpy(p, *w);
+        *p++ = w[1] ? ' ' : '\n';
+    }
+
+    int m = memfd_create("wish-here", MFD_CLOEXEC);
+    if (m < 0)
+        return -1;
+    if (write_all_fd(m, text, len) != 0 || lseek(m, 0, SEEK_SET) != 0) {
+        close(m);
+        return -1;
+    }
+    *fd = m;
+    return 0;
+}
+
+// Opens a '>>' target; the shell does it so every backend just gets an fd
+static int open_append(const char *path) {
+    return open(path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0666);
+}
+
+// run_external():
+// Launches the external program(s) of one segment (like /bin/ls, or
+// every stage of a pipeline) and adds each child to the job table.
+// Handles redirection (if cmd->redir != NULL) on the last stage.
+// Stages are connected with pipe2(O_CLOEXEC) pipes and all run at once.
+// Parent continues after child creation.
+// Returns how many children were started, or -1 on error.
+
+static int run_external(struct command *cmd) {
+    // sanity check
+    if (!cmd || cmd->nstages == 0 || !cmd->stages[0][0]) {
+        err();
+        return -1;
+    }
+
+    // --spawn=remote: names are resolved on the agent
+    if (g_spawn == SPAWN_REMOTE)
+        return remote_run(cmd);
+
+    size_t n = cmd->nstages;
+    char **progs = arena_alloc(&g_line_arena, n * sizeof *progs);
+
+    // resolve every stage first, so a bad name doesn't leave half a pipeline
+    for (size_t i = 0; i < n; i++) {
+        progs[i] = find_prog(cmd->stages[i][0]);
+        if (!progs[i]) {
+            while (i-- > 0)
+                free(progs[i]);
+            err();
+            return -1;
+        }
+    }
+
+    // '<' / '<<<' feed the first stage; a '>>' file is opened here and
+    // shared by the last stage's stdout and stderr
+    int in_fd; // read end feeding the next stage
+    int app_fd = -1;
+    if (open_input(cmd, &in_fd) != 0 ||
+        (cmd->redir && cmd->append && (app_fd = open_append(cmd->redir)) < 0)) {
+        if (in_fd >= 0)
+            close(in_fd);
+        for (size_t i = 0; i < n; i++)
+            free(progs[i]);
+        err();
+        return -1;
+    }
+
+    // --capture: the segment's stderr, and the last stage's stdout unless it has a '>'
+    int cap_fd = -1;
+    if (g_capture && !(n == 1 && cmd->redir))
+        cap_fd = capture_begin();
+
+    int started = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        int p[2] = { -1, -1 };
+        int last = (i == n - 1);
+
+        if (!last && pipe2(p, O_CLOEXEC) != 0) {
+            err();
+            break; // the paths still not spawned are freed below
+        }
+
+        // assuming that the program exists, create the child process
+        int out_fd = last ? (cmd->redir ? app_fd : cap_fd) : p[1];
+        pid_t pid = spawn_job(progs[i], cmd->stages[i], in_fd, out_fd,
+                              last && app_fd >= 0 ? app_fd : cap_fd,
+                              last && !cmd->append ? cmd->redir : NULL);
+        free(progs[i]);
+        progs[i] = NULL;
+        if (pid > 0)
+            started++;
+
+        // the children hold their own copies of the pipe ends now
+        if (in_fd >= 0)
+            close(in_fd);
+        if (!last)
+            close(p[1]);
+        in_fd = p[0];
+    }
+
+    // an early break leaves a read end and unresolved paths behind
+    if (in_fd >= 0)
+        close(in_fd);
+    if (cap_fd >= 0)
+        close(cap_fd); // EOF once the children are done with it
+    if (app_fd >= 0)
+        close(app_fd);
+    for (size_t i = 0; i < n; i++)
+        free(progs[i]);
+
+    return started;
+}
+
+// Blocks until the job added last has exited
+static void job_wait_last(void) {
+    size_t idx = g_njobs - 1;
+    while (!g_jobs[idx].done)
+        ev_run(-1);
+}
+
+/*
+ * run_repeat():
+ * Runs argv `n` times, each copy after the previous one has exited, or
+ * all at once with `parallel` (still under the -j cap). The name is
+ * resolved once and every copy is spawned from that path; shell builtins
+ * and --inline utilities loop inside the shell instead. Every copy gets
+ * the redirections of `seg` (a '>' truncating for each, as separate
+ * lines would). Stops at the first copy that can't be started.
+ */
+static void run_repeat(char **argv, size_t n, int parallel, const struct command *seg) {
+    const struct builtin *bi = builtin_find(argv[0]);
+    if (bi && bi->run) {
+        for (size_t i = 0; i < n; i++)
+            bi->run(argv);
+        return;
+    }
+
+    // --spawn=remote: the agent resolves the name for every copy
+    if (g_spawn == SPAWN_REMOTE) {
+        struct command cmd = *seg;
+        cmd.stages = &argv;
+        cmd.nstages = 1;
+        for (size_t i = 0; i < n; i++) {
+            jobs_wait_slot(1);
+            if (remote_run(&cmd) < 0)
+                return;
+            if (!parallel)
+                job_wait_last();
+        }
+        return;
+    }
+
+    char *prog = find_prog(argv[0]);
+    if (!prog) {
+        err();
+        return;
+    }
+    if (bi && g_inline && util_handles(bi->util, argv)) {
+        for (size_t i = 0; i < n; i++)
+            run_util(bi->util, argv, seg->redir, seg->append);
+        free(prog);
+        return;
+    }
+
+    int app_fd = -1;
+    if (seg->redir && seg->append && (app_fd = open_append(seg->redir)) < 0) {
+        free(prog);
+        err();
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        int in_fd;
+        if (open_input(seg, &in_fd) != 0) {
+            err();
+            break;
+        }
+        jobs_wait_slot(1);
+        int cap_fd = g_capture && !seg->redir ? capture_begin() : -1;
+        pid_t pid = spawn_job(prog, argv, in_fd, app_fd >= 0 ? app_fd : cap_fd,
+                              app_fd >= 0 ? app_fd : cap_fd, seg->append ? NULL : seg->redir);
+        if (cap_fd >= 0)
+            close(cap_fd);
+        if (in_fd >= 0)
+            close(in_fd);
+        if (pid <= 0)
+            break;
+        if (!parallel)
+            job_wait_last();
+    }
+    if (app_fd >= 0)
+        close(app_fd);
+    free(prog);
+}
+
+
+/* ===========================================================
+   ==========             REMOTE AGENT               ==========
+   =========================================================== */
+
+/*
+ * `wish --agent` is the other end of --spawn=remote. It reads RUN frames
+ * on stdin, starts each segment's stages as a pipeline (in the cwd and
+ * with the path the shell sent), streams the segment's stdout and
+ * stderr back as OUT/ERR frames on stdout and finishes with an EXIT
+ * frame once every stage is reaped and the output is drained. Many
+ * segments run at once. At EOF on stdin it finishes what it has and
+ * exits.
+ */
+struct agent_seg {
+    uint32_t id;
+    pid_t *pids;     // one per stage; 0 once reaped, -1 if not started
+    size_t nstages;
+    size_t running;
+    int status;      // of the last stage
+    int failed;
+    int out_fd, err_fd; // read ends, -1 once drained
+    struct rexit ex;
+};
+
+static struct agent_seg **g_asegs = NULL;
+static size_t g_nasegs = 0, g_asegs_cap = 0;
+
+static void agent_send(uint32_t type, uint32_t id, const void *data, size_t len) {
+    struct rframe fr = { type, id, (uint32_t)len };
+    if (write_full(STDOUT_FILENO, &fr, sizeof fr) != 0 ||
+        write_full(STDOUT_FILENO, data, len) != 0)
+        _exit(1); // the shell is gone
+}
+
+// Makes `dirs` the path (only when it differs, since it flushes the cache)
+static void agent_set_path(char **dirs, uint32_t n) {
+    size_t same = g_path != NULL;
+    for (uint32_t i = 0; same && i < n; i++)
+        same = g_path[i] && strcmp(g_path[i], dirs[i]) == 0;
+    if (same && !g_path[n])
+        return;
+
+    path_free();
+    hash_flush();
+    g_path = calloc(n + 1, sizeof *g_path);
+    if (!g_path) { err(); exit(1); }
+    for (uint32_t i = 0; i < n; i++) {
+        g_path[i] = strdup(dirs[i]);
+        if (!g_path[i]) { err(); exit(1); }
+    }
+}
+
+// Starts the segment described by one RUN payload
+static void agent_run(uint32_t id, char *data, size_t len) {
+    struct agent_seg *sg = calloc(1, sizeof *sg);
+    if (!sg) { err(); exit(1); }
+    sg->id = id;
+    sg->out_fd = sg->err_fd = -1;
+    sg->failed = 1;
+
+    // fixed header, then strings; anything malformed just fails the segment
+    uint32_t hdr[3];
+    char **strs = NULL;
+    char **progs = NULL;
+    size_t nstr = 0, nprogs = 0;
+    if (len < sizeof hdr || data[len - 1] != '\0')
+        goto done;
+    memcpy(hdr, data, sizeof hdr);
+    size_t nstages = hdr[0], npath = hdr[1];
+    int has_redir = hdr[2] != 0;
+    size_t off = sizeof hdr + nstages * sizeof(uint32_t);
+    if (nstages == 0 || nstages > len || off > len)
+        goto done;
+    uint32_t *argcs = (uint32_t *)(data + sizeof hdr);
+
+    strs = malloc((len - off + 1) * sizeof *strs);
+    if (!strs) { err(); exit(1); }
+    for (size_t p = off; p < len; p += strlen(data + p) + 1)
+        strs[nstr++] = data + p;
+
+    size_t need = 1 + npath;
+    for (size_t i = 0; i < nstages; i++) {
+        uint32_t argc;
+        memcpy(&argc, &argcs[i], sizeof argc);
+        if (argc == 0)
+            goto done;
+        need += argc + 1; // argv[] gets a NULL after it below
+    }
+    if (need - nstages > nstr)
+        goto done;
+
+    if (chdir(strs[0]) != 0)
+        goto done;
+    agent_set_path(strs + 1, (uint32_t)npath);
+
+    // lay every stage's argv out NULL-terminated, then resolve them all
+    char **argvs = arena_alloc(&g_line_arena, (need + 1) * sizeof *argvs);
+    char ***stage = arena_alloc(&g_line_arena, nstages * sizeof *stage);
+    size_t s = 1 + npath, k = 0;
+    for (size_t i = 0; i < nstages; i++) {
+        uint32_t argc;
+        memcpy(&argc, &argcs[i], sizeof argc);
+        stage[i] = &argvs[k];
+        for (uint32_t a = 0; a < argc; a++)
+            argvs[k++] = strs[s++];
+        argvs[k++] = NULL;
+    }
+    progs = calloc(nstages, sizeof *progs);
+    if (!progs) { err(); exit(1); }
+    for (; nprogs < nstages; nprogs++) {
+        if (!(progs[nprogs] = find_prog(stage[nprogs][0])))
+            goto done;
+    }
+
+    int outp[2], errp[2];
+    if (pipe2(outp, O_CLOEXEC) != 0)
+        goto done;
+    if (pipe2(errp, O_CLOEXEC) != 0) {
+        close(outp[0]);
+        close(outp[1]);
+        goto done;
+    }
+
+    sg->pids = calloc(nstages, sizeof *sg->pids);
+    if (!sg->pids) { err(); exit(1); }
+    sg->nstages = nstages;
+    sg->failed = 0;
+    sg->status = 1 << 8; // if the last stage never starts
+
+    // like run_external(); with '>' the last stage's stderr joins its stdout.
+    // stdin is the connection, so the first stage reads /dev/null instead.
+    int in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    for (size_t i = 0; i < nstages; i++) {
+        int p[2] = { -1, -1 };
+        int last = (i == nstages - 1);
+        if (!last && pipe2(p, O_CLOEXEC) != 0)
+            p[0] = p[1] = -1;
+        pid_t pid = spawn_posix(progs[i], stage[i], in_fd, last ? outp[1] : p[1],
+                                last && has_redir ? outp[1] : errp[1], NULL);
+        sg->pids[i] = pid > 0 ? pid : -1;
+        if (pid > 0)
+            sg->running++;
+        if (in_fd >= 0)
+            close(in_fd);
+        if (p[1] >= 0)
+            close(p[1]);
+        in_fd = p[0];
+    }
+    if (in_fd >= 0)
+        close(in_fd);
+    close(outp[1]);
+    close(errp[1]);
+    sg->out_fd = outp[0];
+    sg->err_fd = errp[0];
+
+done:
+    for (size_t i = 0; i < nprogs; i++)
+        free(progs[i]);
+    free(progs);
+    free(strs);
+    arena_reset(&g_line_arena);
+
+    if (g_nasegs == g_asegs_cap) {
+        g_asegs_cap = g_asegs_cap ? g_asegs_cap * 2 : 32;
+        g_asegs = realloc(g_asegs, g_asegs_cap * sizeof *g_asegs);
+        if (!g_asegs) { err(); exit(1); }
+    }
+    g_asegs[g_nasegs++] = sg;
+}
+
+// Reaps finished stages and credits them to their segments
+static void agent_reap(void) {
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        for (size_t i = 0; i < g_nasegs; i++) {
+            struct agent_seg *sg = g_asegs[i];
+            for (size_t k = 0; k < sg->nstages; k++) {
+                if (sg->pids[k] != pid)
+                    continue;
+                sg->pids[k] = 0;
+                sg->running--;
+                if (k == sg->nstages - 1)
+                    sg->status = status;
+                sg->ex.user_us += (int64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+                sg->ex.sys_us += (int64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+                if (ru.ru_maxrss > sg->ex.maxrss_kb)
+                    sg->ex.maxrss_kb = ru.ru_maxrss;
+                goto next;
+            }
+        }
+    next:
+        ;
+    }
+}
+
+// Forwards what one of a segment's pipes has; closes it at EOF
+static void agent_drain(struct agent_seg *sg, int *fd, uint32_t type) {
+    char chunk[65536];
+    ssize_t r = read(*fd, chunk, sizeof chunk);
+    if (r < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (r > 0) {
+        agent_send(type, sg->id, chunk, (size_t)r);
+        return;
+    }
+    close(*fd);
+    *fd = -1;
+}
+
+/*
+ * agent_main():
+ * The --agent loop: frames on stdin, SIGCHLD on a signalfd and every
+ * segment's output pipes, all through one poll().
+ */
+static int agent_main(void) {
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_BLOCK, &chld, &g_child_mask);
+    sigdelset(&g_child_mask, SIGCHLD);
+    int sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) { err(); exit(1); }
+    path_init();
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t ncpu = cpus > 0 ? (uint32_t)cpus : 1;
+    agent_send(RF_HELLO, 0, &ncpu, sizeof ncpu);
+
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int eof = 0;
+    struct pollfd *pf = NULL;
+    size_t pf_cap = 0;
+
+    while (!eof || g_nasegs > 0) {
+        size_t need = 2 + 2 * g_nasegs;
+        if (need > pf_cap) {
+            pf_cap = need * 2;
+            pf = realloc(pf, pf_cap * sizeof *pf);
+            if (!pf) { err(); exit(1); }
+        }
+        size_t n = 0;
+        pf[n++] = (struct pollfd){ eof ? -1 : STDIN_FILENO, POLLIN, 0 };
+        pf[n++] = (struct pollfd){ sfd, POLLIN, 0 };
+        for (size_t i = 0; i < g_nasegs; i++) {
+            pf[n++] = (struct pollfd){ g_asegs[i]->out_fd, POLLIN, 0 };
+            pf[n++] = (struct pollfd){ g_asegs[i]->err_fd, POLLIN, 0 };
+        }
+        if (poll(pf, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+
+        // output first, so it is all sent before the EXIT that follows
+        for (size_t i = 0; i < g_nasegs; i++) {
+            if (pf[2 + 2 * i].revents)
+                agent_drain(g_asegs[i], &g_asegs[i]->out_fd, RF_OUT);
+            if (pf[3 + 2 * i].revents)
+                agent_drain(g_asegs[i], &g_asegs[i]->err_fd, RF_ERR);
+        }
+
+        if (pf[1].revents) {
+            struct signalfd_siginfo si;
+            while (read(sfd, &si, sizeof si) > 0) {
+            }
+            agent_reap();
+        }
+
+        if (pf[0].revents) {
+            if (cap - len < 65536) {
+                cap = cap ? cap * 2 : 131072;
+                buf = realloc(buf, cap);
+                if (!buf) { err(); exit(1); }
+            }
+            ssize_t r = read(STDIN_FILENO, buf + len, cap - len);
+            if (r > 0) {
+                len += (size_t)r;
+            } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+                eof = 1;
+            }
+
+            size_t off = 0;
+            struct rframe fr;
+            while (len - off >= sizeof fr) {
+                memcpy(&fr, buf + off, sizeof fr);
+                if (len - off - sizeof fr < fr.len)
+                    break;
+                if (fr.type == RF_RUN)
+                    agent_run(fr.id, buf + off + sizeof fr, fr.len);
+                off += sizeof fr + fr.len;
+            }
+            memmove(buf, buf + off, len - off);
+            len -= off;
+        }
+
+        // segments with every stage reaped and both pipes drained are done
+        for (size_t i = g_nasegs; i-- > 0; ) {
+            struct agent_seg *sg = g_asegs[i];
+            if (sg->running || sg->out_fd >= 0 || sg->err_fd >= 0)
+                continue;
+            sg->ex.status = sg->status;
+            sg->ex.failed = sg->failed;
+            agent_send(RF_EXIT, sg->id, &sg->ex, sizeof sg->ex);
+            free(sg->pids);
+            free(sg);
+            g_asegs[i] = g_asegs[--g_nasegs];
+        }
+    }
+
+    free(pf);
+    free(buf);
+    free(g_asegs);
+    close(sfd);
+    shell_shutdown();
+    return 0;
+}
+
+/* ===========================================================
+   ==========             INPUT SOURCES              ==========
+   =========================================================== */
+
+/*
+ * Where command lines come from. A regular batch file is mmap()ed
+ * privately and read-write, so input_next() can hand the lexer a
+ * slice of the mapping and let it write its NULs in place (only the
+ * touched pages get copied). No per-line copy is made. stdin, pipes and
+ * anything that can't be mapped are read() into a buffer of our own, so
+ * we always know whether a whole line is already waiting in it. When
+ * none is and background jobs are running, the wait for more input goes
+ * through the event loop, which reaps them as they exit. (getline() on
+ * stdio can't tell us that without looking inside the FILE, and making
+ * stdin O_NONBLOCK would change it for every child sharing it too.)
+ */
+struct input {
+    int fd;       // streaming source, or -1 when mapped
+    char *line;   // stream buffer / copy of an unterminated last line
+    size_t cap;
+    size_t start; // stream bytes in line[start, end) not handed out yet
+    size_t end;
+    char *map;    // the whole mapped file
+    size_t size;
+    size_t off;   // first byte not handed out yet
+
+    // --precompile: the compiled lines still to run (cw == NULL: lex)
+    const uint32_t *cw, *cw_end;
+    char *cstr;           // their strings
+    void *cmap;           // the mapped .wishc, or
+    size_t cmap_size;
+    uint32_t *cmem_w;     // ... the form compiled by this run
+    char *cmem_s;
+};
+
+static void input_stream(struct input *in, int fd) {
+    memset(in, 0, sizeof *in);
+    in->fd = fd;
+}
+
+// Opens a batch file. Returns 0 on success, -1 if it can't be read.
+static int input_open(struct input *in, const char *path) {
+    memset(in, 0, sizeof *in);
+    in->fd = -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // empty file: nothing to map, nothing to run
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+            in->map = m;
+            in->size = (size_t)st.st_size;
+            close(fd);
+            return 0;
+        }
+    }
+
+    // not mappable (fifo, /dev/stdin, ...): stream it
+    in->fd = fd;
+    return 0;
+}
+
+static int g_input_ready = 0;
+
+static void ev_on_input(struct ev_source *src, uint32_t events) {
+    (void)src;
+    (void)events;
+    g_input_ready = 1;
+}
+
+static struct ev_source g_ev_input = { -1, ev_on_input };
+
+// Blocks until `in` is readable, reaping background jobs meanwhile
+static void input_wait(struct input *in) {
+    if (g_bg_running == 0 || ev_try_add(&g_ev_input, in->fd, EPOLLIN) != 0)
+        return; // just block in read()
+    g_input_ready = 0;
+    while (!g_input_ready && g_bg_running > 0)
+        ev_run(-1);
+    ev_del(&g_ev_input);
+}
+
+// Reads the next line of a stream into in->line; NULL at EOF
+static char *input_read_line(struct input *in, size_t *len) {
+    for (;;) {
+        char *nl = in->end > in->start ?
+                   memchr(in->line + in->start, '\n', in->end - in->start) : NULL;
+        if (nl) {
+            char *line = in->line + in->start;
+            *len = (size_t)(nl - line);
+            in->start += *len + 1;
+            return line;
+        }
+
+        // keep the partial line at the front, with a spare byte for its NUL
+        if (in->start) {
+            memmove(in->line, in->line + in->start, in->end - in->start);
+            in->end -= in->start;
+            in->start = 0;
+        }
+        if (in->end + 1 >= in->cap) {
+            in->cap = in->cap ? in->cap * 2 : 65536;
+            in->line = realloc(in->line, in->cap);
+            if (!in->line) { err(); exit(1); }
+        }
+
+        input_wait(in);
+        ssize_t r = read(in->fd, in->line + in->end, in->cap - in->end - 1);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            // EOF: whatever is left is the last line
+            if (in->end == in->start)
+                return NULL;
+            *len = in->end - in->start;
+            in->start = in->end;
+            return in->line;
+        }
+        in->end += (size_t)r;
+    }
+}
+
+/*
+ * input_next():
+ * Returns the next line with trailing newlines stripped, NUL-terminated
+ * and with line[*len] writable, or NULL at EOF. The line stays valid
+ * until the next call.
+ */
+static char *input_next(struct input *in, size_t *len) {
+    char *line;
+    size_t n;
+
+    if (in->fd >= 0) {
+        line = input_read_line(in, &n);
+        if (!line)
+            return NULL;
+    } else {
+        if (in->off >= in->size)
+            return NULL;
+
+        line = in->map + in->off;
+        char *nl = memchr(line, '\n', in->size - in->off);
+        if (nl) {
+            n = (size_t)(nl - line);
+            in->off += n + 1;
+        } else {
+            // last line has no newline, so there's no byte after it we
+            // may write the NUL into; this is the one line we copy
+            n = in->size - in->off;
+            in->off = in->size;
+            free(in->line);
+            in->line = malloc(n + 1);
+            if (!in->line) { err(); exit(1); }
+            memcpy(in->line, line, n);
+            line = in->line;
+        }
+    }
+
+    // strip trailing newlines
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) n--;
+    line[n] = '\0';
+
+    *len = n;
+    return line;
+}
+
+static void input_close(struct input *in) {
+    if (in->map)
+        munmap(in->map, in->size);
+    if (in->cmap)
+        munmap(in->cmap, in->cmap_size);
+    free(in->cmem_w);
+    free(in->cmem_s);
+    if (in->fd > STDIN_FILENO)
+        close(in->fd);
+    free(in->line);
+    memset(in, 0, sizeof *in);
+    in->fd = -1;
+}
+
+
+/* ===========================================================
+   ==========       PRECOMPILED BATCH FILES          ==========
+   =========================================================== */
+
+/*
+ * --precompile[=DIR] saves a batch file's parsed form the first time it
+ * runs and maps it on later runs, so lines go from disk straight to
+ * spawning without being lexed. The compiled file is <batch>.wishc, or
+ * DIR/<device>-<inode>.wishc for the source, laid out as
+ *
+ *   header | words (uint32_t) | strings (every token, NUL-terminated)
+ *
+ * and each line is, in words:
+ *   nsegs, background, then per segment: bad, nstages, redir, append,
+ *   input (string offsets + 1, or 0), nhere and nhere string offsets,
+ *   then per stage: argc and argc string offsets
+ *
+ * Decoding a line only fills argv[] arrays in the line arena with
+ * pointers into the mapping. Bad segments are kept, so err() still fires
+ * at the same place. The header records the source's size, mtime, inode
+ * and FNV-1a hash; if the metadata moved, the hash decides whether the
+ * compiled form still applies, and anything that doesn't check out is
+ * recompiled. A cache that can't be written is not an error: that run
+ * uses the form it compiled in memory.
+ */
+#define WC_MAGIC "wishc03\n"
+
+struct wc_header {
+    char magic[8];
+    uint64_t src_size;
+    int64_t src_mtime_ns;
+    uint64_t src_ino;
+    uint64_t src_hash;
+    uint64_t nwords;
+    uint64_t nstr; // bytes of strings
+};
+
+static const char *g_precompile = NULL; // --precompile: "" for next to the batch file, or DIR
+
+static uint64_t fnv64(uint64_t h, const void *p, size_t n) {
+    const unsigned char *s = p;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ s[i]) * 1099511628211u;
+    return h;
+}
+
+static uint64_t fnv64_str(uint64_t h, const char *s) {
+    return fnv64(h, s, strlen(s) + 1); // the NUL keeps "ab c" from matching "a bc"
+}
+
+#define FNV64_INIT 14695981039346656037u
+
+// Growable word / string buffers for compiling
+struct wc_buf {
+    uint32_t *w;
+    size_t nw, wcap;
+    char *s;
+    size_t ns, scap;
+};
+
+static void wc_word(struct wc_buf *b, uint32_t v) {
+    if (b->nw == b->wcap) {
+        b->wcap = b->wcap ? b->wcap * 2 : 4096;
+        b->w = realloc(b->w, b->wcap * sizeof *b->w);
+        if (!b->w) { err(); exit(1); }
+    }
+    b->w[b->nw++] = v;
+}
+
+// Appends a token to the string table; returns its offset
+static uint32_t wc_str(struct wc_buf *b, const char *tok) {
+    size_t n = strlen(tok) + 1;
+    if (b->ns + n > b->scap) {
+        while (b->ns + n > b->scap)
+            b->scap = b->scap ? b->scap * 2 : 65536;
+        b->s = realloc(b->s, b->scap);
+        if (!b->s) { err(); exit(1); }
+    }
+    memcpy(b->s + b->ns, tok, n);
+    b->ns += n;
+    return (uint32_t)(b->ns - n);
+}
+
+static void wc_encode(struct wc_buf *b, const struct cmdlist *cl) {
+    wc_word(b, (uint32_t)cl->n);
+    wc_word(b, (uint32_t)cl->background);
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        wc_word(b, (uint32_t)c->bad);
+        wc_word(b, (uint32_t)c->nstages);
+        wc_word(b, c->redir ? wc_str(b, c->redir) + 1 : 0);
+        wc_word(b, (uint32_t)c->append);
+        wc_word(b, c->input ? wc_str(b, c->input) + 1 : 0);
+        size_t nhere = 0;
+        while (c->here && c->here[nhere])
+            nhere++;
+        wc_word(b, c->here ? (uint32_t)nhere + 1 : 0);
+        for (size_t k = 0; k < nhere; k++)
+            wc_word(b, wc_str(b, c->here[k]));
+        for (size_t k = 0; k < c->nstages; k++) {
+            size_t argc = 0;
+            while (c->stages[k][argc])
+                argc++;
+            wc_word(b, (uint32_t)argc);
+            for (size_t a = 0; a < argc; a++)
+                wc_word(b, wc_str(b, c->stages[k][a]));
+        }
+    }
+}
+
+/*
+ * wc_valid():
+ * Walks a compiled word stream and checks every count and string offset
+ * stays in bounds, so decoding can trust it. Returns 1 if it does.
+ */
+static int wc_valid(const uint32_t *w, size_t nwords, const char *str, size_t nstr) {
+    if (nstr > 0 && str[nstr - 1] != '\0')
+        return 0;
+#define WC_TAKE(v) do { if (i == nwords) return 0; (v) = w[i++]; } while (0)
+    size_t i = 0;
+    while (i < nwords) {
+        uint32_t nsegs, bg, bad, nstages, redir, append, input, nhere, argc, off;
+        WC_TAKE(nsegs);
+        WC_TAKE(bg);
+        if (bg > 1)
+            return 0;
+        for (uint32_t s = 0; s < nsegs; s++) {
+            WC_TAKE(bad);
+            WC_TAKE(nstages);
+            WC_TAKE(redir);
+            WC_TAKE(append);
+            WC_TAKE(input);
+            WC_TAKE(nhere);
+            if (bad > 1 || redir > nstr || append > 1 || input > nstr)
+                return 0;
+            for (uint32_t k = 1; k < nhere; k++) {
+                WC_TAKE(off);
+                if (off >= nstr)
+                    return 0;
+            }
+            for (uint32_t k = 0; k < nstages; k++) {
+                WC_TAKE(argc);
+                for (uint32_t a = 0; a < argc; a++) {
+                    WC_TAKE(off);
+                    if (off >= nstr)
+                        return 0;
+                }
+            }
+        }
+    }
+#undef WC_TAKE
+    return 1;
+}
+
+// Rebuilds the next compiled line of `in` in arena `a`
+static void wc_decode(struct input *in, struct arena *a, struct cmdlist *cl) {
+    const uint32_t *w = in->cw;
+    char *str = in->cstr;
+
+    cl->n = *w++;
+    cl->background = (int)*w++;
+    cl->cmds = arena_alloc(a, cl->n * sizeof *cl->cmds);
+    for (size_t i = 0; i < cl->n; i++) {
+        struct command *c = &cl->cmds[i];
+        c->bad = (int)*w++;
+        c->nstages = *w++;
+        uint32_t redir = *w++;
+        c->redir = redir ? str + redir - 1 : NULL;
+        c->append = (int)*w++;
+        uint32_t input = *w++;
+        c->input = input ? str + input - 1 : NULL;
+        uint32_t nhere = *w++; // words + 1, or 0 for no '<<<'
+        c->here = NULL;
+        if (nhere) {
+            c->here = arena_alloc(a, nhere * sizeof *c->here);
+            for (uint32_t j = 0; j + 1 < nhere; j++)
+                c->here[j] = str + *w++;
+            c->here[nhere - 1] = NULL;
+        }
+        c->stages = arena_alloc(a, c->nstages * sizeof *c->stages);
+        for (size_t k = 0; k < c->nstages; k++) {
+            uint32_t argc = *w++;
+            char **argv = arena_alloc(a, (argc + 1) * sizeof *argv);
+            for (uint32_t j = 0; j < argc; j++)
+                argv[j] = str + *w++;
+            argv[argc] = NULL;
+            c->stages[k] = argv;
+        }
+    }
+    in->cw = w;
+}
+
+/*
+ * wc_map():
+ * Maps the compiled file at `path` if it matches `want` (a header with
+ * the source's size, mtime and inode; *hash is the source's content hash,
+ * computed here on demand and 0 until then). Returns 0 on success.
+ */
+static int wc_map(struct input *in, const char *path, const struct wc_header *want, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct wc_header)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        return -1;
+
+    struct wc_header h;
+    memcpy(&h, m, sizeof h);
+    int ok = memcmp(h.magic, WC_MAGIC, sizeof h.magic) == 0 &&
+             h.src_size == want->src_size &&
+             h.nwords <= (size - sizeof h) / sizeof(uint32_t) &&
+             h.nstr == size - sizeof h - h.nwords * sizeof(uint32_t);
+    if (ok && (h.src_mtime_ns != want->src_mtime_ns || h.src_ino != want->src_ino)) {
+        // touched or copied: still good if the bytes are the same
+        if (!*hash)
+            *hash = fnv64(FNV64_INIT, in->map, in->size);
+        ok = h.src_hash == *hash;
+    }
+    const uint32_t *w = (const uint32_t *)((char *)m + sizeof h);
+    char *str = (char *)m + sizeof h + h.nwords * sizeof(uint32_t);
+    if (!ok || !wc_valid(w, h.nwords, str, h.nstr)) {
+        munmap(m, size);
+        return -1;
+    }
+
+    in->cmap = m;
+    in->cmap_size = size;
+    in->cw = w;
+    in->cw_end = w + h.nwords;
+    in->cstr = str;
+    return 0;
+}
+
+// Writes a freshly compiled file via a temporary, so readers never see half of one
+static void wc_write(const char *path, const struct wc_header *h, const struct wc_buf *b) {
+    size_t need = strlen(path) + sizeof ".tmp";
+    char *tmp = malloc(need);
+    if (!tmp) { err(); exit(1); }
+    snprintf(tmp, need, "%s.tmp", path);
+
+    int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        int ok = write_all_fd(fd, (const char *)h, sizeof *h) == 0 &&
+                 write_all_fd(fd, (const char *)b->w, b->nw * sizeof *b->w) == 0 &&
+                 write_all_fd(fd, b->s, b->ns) == 0;
+        if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(tmp);
+}
+
+/*
+ * input_precompile():
+ * With --precompile, switches the mapped batch file `in` (opened from
+ * `path`) over to its compiled form, compiling it first if needed.
+ */
+static void input_precompile(struct input *in, const char *path) {
+    struct stat st;
+    if (!g_precompile || !in->map || in->size > UINT32_MAX / 2 || stat(path, &st) != 0)
+        return; // nothing mapped, or too big for 32-bit string offsets
+
+    struct wc_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, WC_MAGIC, sizeof h.magic);
+    h.src_size = in->size;
+    h.src_mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    h.src_ino = (uint64_t)st.st_ino;
+
+    // <batch>.wishc, or DIR/<dev>-<ino>.wishc (named so that an unchanged
+    // source is found without hashing it)
+    char *cpath;
+    if (*g_precompile) {
+        size_t need = strlen(g_precompile) + 48;
+        cpath = malloc(need);
+        if (cpath)
+            snprintf(cpath, need, "%s/%" PRIx64 "-%" PRIx64 ".wishc", g_precompile,
+                     (uint64_t)st.st_dev, (uint64_t)st.st_ino);
+    } else {
+        size_t need = strlen(path) + sizeof ".wishc";
+        cpath = malloc(need);
+        if (cpath)
+            snprintf(cpath, need, "%s.wishc", path);
+    }
+    if (!cpath) { err(); exit(1); }
+
+    uint64_t t0 = now_ns();
+    if (wc_map(in, cpath, &h, &h.src_hash) != 0) {
+        if (!h.src_hash)
+            h.src_hash = fnv64(FNV64_INIT, in->map, in->size);
+
+        // lex the whole file once (in place, it isn't read again)
+        struct wc_buf b;
+        memset(&b, 0, sizeof b);
+        size_t n;
+        char *line;
+        while ((line = input_next(in, &n)) != NULL) {
+            struct cmdlist cl;
+            lex_line(&g_line_arena, line, n, &cl);
+            wc_encode(&b, &cl);
+            arena_reset(&g_line_arena);
+        }
+        h.nwords = b.nw;
+        h.nstr = b.ns;
+        wc_write(cpath, &h, &b);
+
+        in->cmem_w = b.w;
+        in->cmem_s = b.s;
+        in->cw = b.w;
+        in->cw_end = b.w + b.nw;
+        in->cstr = b.s;
+    }
+    g_stats.parse_ns += now_ns() - t0;
+    free(cpath);
+
+    // the source itself isn't needed any more
+    munmap(in->map, in->size);
+    in->map = NULL;
+    in->size = in->off = 0;
+}
+
+// Lexes or decodes the next line of `in` into `a`; 0 at EOF
+static int input_parse(struct input *in, struct arena *a, struct cmdlist *cl) {
+    if (in->cw) {
+        if (in->cw == in->cw_end)
+            return 0;
+        wc_decode(in, a, cl);
+        return 1;
+    }
+    size_t n;
+    char *line = input_next(in, &n);
+    if (!line)
+        return 0;
+    lex_line(a, line, n, cl);
+    return 1;
+}
+
+/* ===========================================================
+   ==========              LOOKAHEAD                 ==========
+   =========================================================== */
+
+/*
+ * With --lookahead=K, a mapped batch file is read ahead while the
+ * current line's children run: up to K upcoming lines are lexed into
+ * arenas of their own and their command names resolved, which warms the
+ * executable cache. When the line comes up, run_input() takes its
+ * parsed form from the queue.
+ *
+ * Lexing doesn't depend on shell state, but resolution does: a queued
+ * line that runs `cd` or `path` is a barrier, and nothing after it is
+ * resolved until it has run. Warmed entries are ordinary cache entries,
+ * so they are re-checked when used like any other hit.
+ */
+struct ahead_line {
+    struct arena arena;
+    struct cmdlist cl;
+    int barrier; // runs cd or path
+};
+
+static size_t g_ahead_k = 0;            // --lookahead
+static struct ahead_line *g_ahead = NULL; // ring of K+1: the queue, plus the line running now
+static size_t g_ahead_head = 0;         // first queued slot
+static size_t g_ahead_n = 0;            // lines queued
+static size_t g_ahead_warm = 0;         // queued lines already resolved (from the head)
+static struct ahead_line *g_ahead_cur = NULL; // slot of the line being run
+
+static struct ahead_line *ahead_slot(size_t i) {
+    return &g_ahead[(g_ahead_head + i) % (g_ahead_k + 1)];
+}
+
+// Would running this line change how names resolve?
+static int ahead_is_barrier(const struct cmdlist *cl) {
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        if (c->bad || c->nstages != 1)
+            continue; // only single-stage segments run builtins
+        const char *name = c->stages[0][0];
+        if (strcmp(name, "cd") == 0 || strcmp(name, "path") == 0 ||
+            strcmp(name, "source") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Resolves every external command name on a queued line
+static void ahead_warm(const struct cmdlist *cl) {
+    if (!g_path || !g_path[0])
+        return;
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        if (c->bad)
+            continue;
+        for (size_t k = 0; k < c->nstages; k++) {
+            const char *name = c->stages[k][0];
+            if (strchr(name, '/') || (c->nstages == 1 && builtin_find(name)))
+                continue;
+            free(resolve_exec(name));
+        }
+    }
+}
+
+/*
+ * lookahead_fill():
+ * Tops the queue up to K lines from `in` and resolves the queued lines
+ * up to the first barrier. Called while children are running.
+ */
+static void lookahead_fill(struct input *in) {
+    if (!g_ahead_k || (!in->map && !in->cw))
+        return; // streams reuse their line buffer
+
+    if (!g_ahead) {
+        g_ahead = calloc(g_ahead_k + 1, sizeof *g_ahead);
+        if (!g_ahead) { err(); exit(1); }
+    }
+
+    while (g_ahead_n < g_ahead_k) {
+        struct ahead_line *al = ahead_slot(g_ahead_n);
+        uint64_t t0 = now_ns();
+        arena_reset(&al->arena);
+        if (!input_parse(in, &al->arena, &al->cl))
+            break;
+        al->barrier = ahead_is_barrier(&al->cl);
+        g_stats.parse_ns += now_ns() - t0;
+        g_ahead_n++;
+    }
+
+    for (size_t i = 0; i < g_ahead_warm; i++) {
+        if (ahead_slot(i)->barrier)
+            return; // wait until it has run
+    }
+    while (g_ahead_warm < g_ahead_n) {
+        struct ahead_line *al = ahead_slot(g_ahead_warm++);
+        ahead_warm(&al->cl);
+        if (al->barrier)
+            break;
+    }
+}
+
+// Hands out the next queued line, if there is one; 0 when the queue is empty
+static int lookahead_take(struct cmdlist *cl) {
+    if (g_ahead_n == 0)
+        return 0;
+    g_ahead_cur = ahead_slot(0);
+    *cl = g_ahead_cur->cl;
+    g_ahead_head = (g_ahead_head + 1) % (g_ahead_k + 1);
+    g_ahead_n--;
+    if (g_ahead_warm)
+        g_ahead_warm--;
+    return 1;
+}
+
+// The line taken last is done; its slot can be refilled
+static void lookahead_release(void) {
+    if (g_ahead_cur)
+        arena_reset(&g_ahead_cur->arena);
+    g_ahead_cur = NULL;
+}
+
+static void lookahead_free(void) {
+    for (size_t i = 0; g_ahead && i < g_ahead_k + 1; i++)
+        arena_free(&g_ahead[i].arena);
+    free(g_ahead);
+    g_ahead = NULL;
+    g_ahead_n = g_ahead_warm = g_ahead_head = 0;
+    g_ahead_cur = NULL;
+}
+
+/* ===========================================================
+   ==========       INCREMENTAL RE-EXECUTION         ==========
+   =========================================================== */
+
+/*
+ * --incremental[=FILE] skips lines that already ran cleanly and whose
+ * inputs haven't changed since, make-style. A line qualifies when
+ * every segment runs programs (no shell builtins, no syntax errors) and
+ * either sends its output to a '>' file, or the line came right after
+ * `deps FILE...`, so skipping it only saves time.
+ *
+ * A line's key hashes the cwd, every stage's argv, the '>' targets, and
+ * each resolved program with its mtime, size and inode (an upgraded
+ * binary reruns). After a clean run (every child exited 0, and no err()),
+ * the record stores the state of every file the line names: each
+ * argument, the '>' target and the declared deps, including the ones
+ * that don't exist. Until one of those changes, the line is skipped.
+ * Only metadata is compared, not contents; that's the approximation.
+ *
+ * FILE defaults to the batch file's name plus ".wish-incr". It is read
+ * at startup and rewritten at exit, keeping the records of the lines
+ * that were seen this run (all of them if the run stopped early).
+ */
+#define INCR_MAGIC "wish-incr 1"
+
+struct incr_file {
+    char *path;
+    int64_t mtime_ns; // -1: didn't exist
+    int64_t size;
+    uint64_t ino;
+};
+
+struct incr_rec {
+    uint64_t key;
+    struct incr_file *files;
+    size_t nfiles;
+    int used; // matched or written this run
+    struct incr_rec *next;
+};
+
+static int g_incr = 0;                // --incremental
+static const char *g_incr_path = NULL; // the record file
+static struct incr_rec **g_incr_tab = NULL;
+static size_t g_incr_cap = 0;         // buckets, power of two
+static size_t g_incr_count = 0;
+static char **g_incr_next = NULL;     // `deps` files for the next line
+static int g_incr_next_set = 0;       // `deps` ran on this line
+static char **g_incr_deps = NULL;     // ... the line being run now
+static int g_incr_deps_set = 0;
+static int g_incr_complete = 0;       // the input ran to EOF
+
+static void incr_stat(const char *path, struct incr_file *f) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        f->mtime_ns = -1;
+        f->size = 0;
+        f->ino = 0;
+        return;
+    }
+    f->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    f->size = (int64_t)st.st_size;
+    f->ino = (uint64_t)st.st_ino;
+}
+
+static void incr_strv_free(char **v) {
+    for (size_t i = 0; v && v[i]; i++)
+        free(v[i]);
+    free(v);
+}
+
+static void incr_rec_free(struct incr_rec *r) {
+    for (size_t i = 0; i < r->nfiles; i++)
+        free(r->files[i].path);
+    free(r->files);
+    free(r);
+}
+
+static struct incr_rec *incr_find(uint64_t key) {
+    if (!g_incr_tab)
+        return NULL;
+    for (struct incr_rec *r = g_incr_tab[key & (g_incr_cap - 1)]; r; r = r->next) {
+        if (r->key == key)
+            return r;
+    }
+    return NULL;
+}
+
+static void incr_grow(void) {
+    size_t cap = g_incr_cap ? g_incr_cap * 2 : 256;
+    struct incr_rec **tab = calloc(cap, sizeof *tab);
+    if (!tab) { err(); exit(1); }
+    for (size_t i = 0; i < g_incr_cap; i++) {
+        struct incr_rec *r = g_incr_tab[i];
+        while (r) {
+            struct incr_rec *next = r->next;
+            r->next = tab[r->key & (cap - 1)];
+            tab[r->key & (cap - 1)] = r;
+            r = next;
+        }
+    }
+    free(g_incr_tab);
+    g_incr_tab = tab;
+    g_incr_cap = cap;
+}
+
+// Stores a record (taking ownership of `files`), replacing any with the same key
+static void incr_put(uint64_t key, struct incr_file *files, size_t nfiles, int used) {
+    struct incr_rec *r = incr_find(key);
+    if (r) {
+        for (size_t i = 0; i < r->nfiles; i++)
+            free(r->files[i].path);
+        free(r->files);
+    } else {
+        if (g_incr_count >= g_incr_cap)
+            incr_grow();
+        r = malloc(sizeof *r);
+        if (!r) { err(); exit(1); }
+        r->key = key;
+        r->next = g_incr_tab[key & (g_incr_cap - 1)];
+        g_incr_tab[key & (g_incr_cap - 1)] = r;
+        g_incr_count++;
+    }
+    r->files = files;
+    r->nfiles = nfiles;
+    r->used = used;
+}
+
+// Parses one saved record: KEY NFILES then NFILES x (MTIME SIZE INODE PATH)
+static void incr_load_rec(char *p) {
+    char *end;
+    uint64_t key = strtoull(p, &end, 16);
+    if (end == p)
+        return;
+    size_t nfiles = strtoull(end, &p, 10);
+    if (p == end || nfiles > strlen(p))
+        return; // every entry takes a few bytes; this one is corrupt
+
+    struct incr_file *files = calloc(nfiles ? nfiles : 1, sizeof *files);
+    if (!files) { err(); exit(1); }
+    size_t k;
+    for (k = 0; k < nfiles; k++) {
+        struct incr_file *f = &files[k];
+        f->mtime_ns = strtoll(p, &end, 10);
+        f->size = strtoll(end, &p, 10);
+        f->ino = strtoull(p, &end, 10);
+        while (*end == ' ')
+            end++;
+        size_t len = strcspn(end, " \n");
+        if (len == 0)
+            break;
+        f->path = strndup(end, len);
+        if (!f->path) { err(); exit(1); }
+        p = end + len;
+    }
+    if (k < nfiles) {
+        for (size_t i = 0; i < k; i++)
+            free(files[i].path);
+        free(files);
+        return;
+    }
+    incr_put(key, files, nfiles, 0);
+}
+
+static void incr_load(void) {
+    FILE *f = fopen(g_incr_path, "r");
+    if (!f)
+        return; // first run
+
+    char *line = NULL;
+    size_t cap = 0;
+    if (getline(&line, &cap, f) > 0 && strcmp(line, INCR_MAGIC "\n") == 0) {
+        while (getline(&line, &cap, f) > 0)
+            incr_load_rec(line);
+    }
+    free(line);
+    fclose(f);
+}
+
+/*
+ * incr_open():
+ * Turns incremental mode on for `batch` (NULL for stdin, which needs an
+ * explicit --incremental=FILE) and loads its records.
+ */
+static void incr_open(const char *batch) {
+    if (!g_incr)
+        return;
+    if (!g_incr_path) {
+        if (!batch) {
+            err();
+            exit(1);
+        }
+        size_t need = strlen(batch) + sizeof ".wish-incr";
+        char *dflt = malloc(need);
+        if (!dflt) { err(); exit(1); }
+        snprintf(dflt, need, "%s.wish-incr", batch);
+        g_incr_path = abs_path(dflt); // saved at exit, after any cd
+        free(dflt);
+    }
+    incr_load();
+}
+
+// `deps FILE...`: remembered for the next line
+static void incr_declare(char **files) {
+    if (!g_incr)
+        return;
+    size_t n = 0;
+    while (files[n])
+        n++;
+    char **v = malloc((n + 1) * sizeof *v);
+    if (!v) { err(); exit(1); }
+    for (size_t i = 0; i < n; i++) {
+        v[i] = strdup(files[i]);
+        if (!v[i]) { err(); exit(1); }
+    }
+    v[n] = NULL;
+    incr_strv_free(g_incr_next);
+    g_incr_next = v;
+    g_incr_next_set = 1;
+}
+
+/*
+ * incr_key():
+ * Hashes what `cl` runs (see above) into *key. Returns 0 if the line
+ * doesn't qualify for skipping.
+ */
+static int incr_key(const struct cmdlist *cl, uint64_t *key) {
+    if (cl->n == 0)
+        return 0;
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof cwd))
+        return 0;
+    uint64_t h = fnv64_str(FNV64_INIT, cwd);
+
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        if (c->bad || (!c->redir && !g_incr_deps_set))
+            return 0;
+        if (c->nstages == 1) {
+            const struct builtin *bi = builtin_find(c->stages[0][0]);
+            if (bi && bi->run)
+                return 0;
+        }
+
+        for (size_t k = 0; k < c->nstages; k++) {
+            char *prog = find_prog(c->stages[k][0]);
+            if (!prog)
+                return 0; // let it run and report the error
+            struct incr_file f;
+            incr_stat(prog, &f);
+            h = fnv64_str(h, prog);
+            h = fnv64(h, &f.mtime_ns, sizeof f.mtime_ns);
+            h = fnv64(h, &f.size, sizeof f.size);
+            h = fnv64(h, &f.ino, sizeof f.ino);
+            free(prog);
+
+            for (char **a = c->stages[k]; *a; a++)
+                h = fnv64_str(h, *a);
+            h = fnv64(h, "|", 1);
+        }
+        if (c->redir) {
+            h = fnv64(h, c->append ? ">>" : ">", c->append ? 2 : 1);
+            h = fnv64_str(h, c->redir);
+        }
+        if (c->input) {
+            h = fnv64(h, "<", 1);
+            h = fnv64_str(h, c->input);
+        }
+        for (char **w = c->here; w && *w; w++)
+            h = fnv64_str(h, *w);
+        h = fnv64(h, "&", 1);
+    }
+    for (char **d = g_incr_deps; d && *d; d++)
+        h = fnv64_str(h, *d);
+
+    *key = h;
+    return 1;
+}
+
+/*
+ * incr_begin():
+ * Called for every line before it runs. Returns 1 if the line is up to
+ * date and should be skipped; otherwise *key is set when a clean run
+ * should be recorded (and left alone when it shouldn't).
+ */
+static int incr_begin(const struct cmdlist *cl, uint64_t *key, int *record) {
+    *record = 0;
+    if (!g_incr)
+        return 0;
+
+    // a `deps` on the previous line applies to this one only
+    incr_strv_free(g_incr_deps);
+    g_incr_deps = g_incr_next;
+    g_incr_deps_set = g_incr_next_set;
+    g_incr_next = NULL;
+    g_incr_next_set = 0;
+
+    if (!incr_key(cl, key))
+        return 0;
+    *record = 1;
+
+    struct incr_rec *r = incr_find(*key);
+    if (!r)
+        return 0;
+    for (size_t i = 0; i < r->nfiles; i++) {
+        struct incr_file now;
+        incr_stat(r->files[i].path, &now);
+        if (now.mtime_ns != r->files[i].mtime_ns || now.size != r->files[i].size ||
+            now.ino != r->files[i].ino)
+            return 0;
+    }
+    r->used = 1;
+    return 1;
+}
+
+static void incr_push_file(struct incr_file **files, size_t *n, size_t *cap, const char *path) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        *files = realloc(*files, *cap * sizeof **files);
+        if (!*files) { err(); exit(1); }
+    }
+    struct incr_file *f = &(*files)[(*n)++];
+    f->path = strdup(path);
+    if (!f->path) { err(); exit(1); }
+    incr_stat(path, f);
+}
+
+/*
+ * incr_end():
+ * Records the files `cl` names once it has finished, if it ran cleanly:
+ * every job (in-shell utilities included) exited 0 and `errors` (the
+ * count from before the line) hasn't moved.
+ */
+static void incr_end(const struct cmdlist *cl, uint64_t key, unsigned long errors) {
+    if (g_errors != errors)
+        return;
+    for (size_t i = 0; i < g_njobs; i++) {
+        if (!g_jobs[i].done || !WIFEXITED(g_jobs[i].status) || WEXITSTATUS(g_jobs[i].status) != 0)
+            return;
+    }
+
+    struct incr_file *files = NULL;
+    size_t n = 0, cap = 0;
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        for (size_t k = 0; k < c->nstages; k++) {
+            for (char **a = c->stages[k] + 1; *a; a++)
+                incr_push_file(&files, &n, &cap, *a);
+        }
+        if (c->redir)
+            incr_push_file(&files, &n, &cap, c->redir);
+        if (c->input)
+            incr_push_file(&files, &n, &cap, c->input);
+    }
+    for (char **d = g_incr_deps; d && *d; d++)
+        incr_push_file(&files, &n, &cap, *d);
+    incr_put(key, files, n, 1);
+}
+
+// Writes the records back (via a temporary file, so a crash keeps the old ones)
+static void incr_save(void) {
+    if (g_incr_path && g_incr_tab) {
+        size_t need = strlen(g_incr_path) + sizeof ".tmp";
+        char *tmp = malloc(need);
+        if (!tmp) { err(); exit(1); }
+        snprintf(tmp, need, "%s.tmp", g_incr_path);
+
+        FILE *f = fopen(tmp, "w");
+        if (f) {
+            fputs(INCR_MAGIC "\n", f);
+            for (size_t i = 0; i < g_incr_cap; i++) {
+                for (struct incr_rec *r = g_incr_tab[i]; r; r = r->next) {
+                    if (!r->used && g_incr_complete)
+                        continue; // a line that's no longer in the script
+                    fprintf(f, "%016" PRIx64 " %zu", r->key, r->nfiles);
+                    for (size_t k = 0; k < r->nfiles; k++)
+                        fprintf(f, " %" PRId64 " %" PRId64 " %" PRIu64 " %s",
+                                r->files[k].mtime_ns, r->files[k].size,
+                                r->files[k].ino, r->files[k].path);
+                    fputc('\n', f);
+                }
+            }
+        }
+        if (!f || fclose(f) != 0 || rename(tmp, g_incr_path) != 0) {
+            err();
+            unlink(tmp);
+        }
+        free(tmp);
+    }
+
+    for (size_t i = 0; i < g_incr_cap; i++) {
+        while (g_incr_tab[i]) {
+            struct incr_rec *r = g_incr_tab[i];
+            g_incr_tab[i] = r->next;
+            incr_rec_free(r);
+        }
+    }
+    free(g_incr_tab);
+    g_incr_tab = NULL;
+    g_incr_cap = g_incr_count = 0;
+    incr_strv_free(g_incr_next);
+    incr_strv_free(g_incr_deps);
+    g_incr_next = g_incr_deps = NULL;
+    g_incr_next_set = g_incr_deps_set = 0;
+}
+
+/* ===========================================================
+   ==========          RUNNING A SCRIPT              ==========
+   =========================================================== */
+
+// --cgroup / --pressure: without them children just run unconfined
+static void limits_start(void) {
+    if (g_cg_dir && cgroup_start() != 0)
+        err();
+    if (pressure_start() != 0) {
+        err();
+        pressure_stop();
+    }
+}
+
+/*
+ * shell_init():
+ * Everything the shell sets up once before reading its first line.
+ * With `server` (--serve, -P) this process only forks the shells that
+ * run things, and each of those starts its own groups, agents and
+ * trace (see shell_fork_init()).
+ */
+static void shell_init(int server) {
+    // initialize PATH list to ["/bin", NULL]
+    path_init();
+
+    if (!server)
+        limits_start();
+    else if (g_cg_dir && cgroup_prepare() != 0)
+        err();
+
+    // the fork server is forked now, while the shell is at its smallest
+    if (g_spawn == SPAWN_ZYGOTE && zygote_start() != 0)
+        g_spawn = SPAWN_POSIX;
+
+    // SIGCHLD and the fork server feed one epoll loop from here on
+    ev_init();
+
+    // agents are started with SIGCHLD unblocked, so after ev_init()
+    if (!server && g_spawn == SPAWN_REMOTE && remote_start() != 0)
+        g_spawn = SPAWN_POSIX;
+
+    builtin_init();
+    pathidx_rebuild();
+    if (!server)
+        trace_start();
+}
+
+/*
+ * shell_fork_init():
+ * Turns a child forked from a shell_init(1) process into a shell of its
+ * own. The epoll set, the fork server socket and the inotify fd would be
+ * shared with every sibling, so it gets its own. `zy` is its fork
+ * server connection from zygote_attach() (or -1). The path, the resolve
+ * cache and the PATH index snapshot carry over.
+ */
+static void shell_fork_init(int zy) {
+    ev_free();
+    if (g_zygote_fd >= 0) {
+        close(g_zygote_fd);
+        g_zygote_fd = zy;
+        g_zygote_cwd_stale = 1;
+    }
+    ev_init();
+    if (g_spawn == SPAWN_REMOTE && remote_start() != 0)
+        g_spawn = SPAWN_POSIX;
+    pathidx_rewatch();
+    memset(&g_stats, 0, sizeof g_stats);
+    g_errors = 0;
+    limits_start();
+    trace_start();
+}
+
+// The line `cl` was parsed from, give or take whitespace (for `jobs`)
+static char *line_text(const struct cmdlist *cl) {
+    size_t need = 1;
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        for (size_t k = 0; k < c->nstages; k++) {
+            for (char **a = c->stages[k]; *a; a++)
+                need += strlen(*a) + 1;
+            need += 2;
+        }
+        need += (c->redir ? strlen(c->redir) + 4 : 0) + 2;
+        need += c->input ? strlen(c->input) + 3 : 0;
+        for (char **w = c->here; w && *w; w++)
+            need += strlen(*w) + 5;
+    }
+
+    char *text = malloc(need), *p = text;
+    if (!text) { err(); exit(1); }
+    for (size_t i = 0; i < cl->n; i++) {
+        const struct command *c = &cl->cmds[i];
+        for (size_t k = 0; k < c->nstages; k++) {
+            if (k)
+                p += sprintf(p, "| ");
+            for (char **a = c->stages[k]; *a; a++)
+                p += sprintf(p, "%s ", *a);
+            if (k == 0 && c->input)
+                p += sprintf(p, "< %s ", c->input);
+            for (char **w = c->here; k == 0 && w && *w; w++)
+                p += sprintf(p, "%s%s ", w == c->here ? "<<< " : "", *w);
+        }
+        if (c->redir)
+            p += sprintf(p, "%s %s ", c->append ? ">>" : ">", c->redir);
+        p += sprintf(p, "& ");
+    }
+    if (p > text)
+        p -= 1; // keeps the trailing '&'
+    *p = '\0';
+    return text;
+}
+
+/*
+ * run_line():
+ * Runs the segments of one parsed line and waits for its children.
+ * `in` is where to read ahead from while they run (NULL: nowhere), and
+ * `t_parsed` is when parsing finished, for --stats and --trace.
+ */
+static void run_line(struct cmdlist *cl, struct input *in, int interactive, uint64_t t_parsed) {
+    long line_no = (long)g_stats.lines; // a `source` runs more lines in between
+
+    // statuses from the previous line are no longer needed
+    jobs_clear();
+    pathidx_sync();
+
+    // --incremental: nothing this line depends on has changed
+    uint64_t incr_key = 0;
+    int incr_record;
+    unsigned long errors = g_errors;
+    if (incr_begin(cl, &incr_key, &incr_record)) {
+        g_stats.skipped++;
+        return;
+    }
+
+    // interactive "... &": start it, then straight back to the prompt
+    // (--capture would have to wait for its output, so it's off)
+    int background = interactive && cl->background;
+    enum capture_mode capture = g_capture;
+    if (background) {
+        g_capture = CAPTURE_OFF;
+        incr_record = 0;
+    }
+
+    // process each command segment separately
+    for (size_t i=0; i < cl->n; i++) {
+        struct command *cmd = &cl->cmds[i];
+
+        // bad syntax (more than one >, not exactly one filename after >, no command): skip this segment
+        if (cmd->bad) { 
+            err();
+            continue; 
+        }
+
+        // check for built-ins like exit, cd, or PATH (execute immediately)
+        uint64_t t_bi = g_trace ? now_ns() : 0;
+        if (cmd->nstages == 1 && handle_builtin(cmd)) {
+            if (t_bi)
+                trace_rec(TR_BUILTIN, t_bi, now_ns(), 0, line_no, cmd->stages[0][0]);
+            continue;
+        }
+
+        // respect the parallelism cap before starting more children
+        jobs_wait_slot(cmd->nstages);
+
+        // run the external command(s) (handles forking internally)
+        run_external(cmd);
+    }
+
+    if (background) {
+        g_capture = capture;
+        if (g_njobs)
+            bg_adopt(line_text(cl));
+    }
+
+    // get ahead on the next lines while the children run
+    if (in && g_jobs_running > 0)
+        lookahead_fill(in);
+
+    // wait for all child processes to finish, in whatever order they exit
+    jobs_wait_all();
+    cg_line_done();
+    capture_finish();
+    if (incr_record)
+        incr_end(cl, incr_key, errors);
+    uint64_t t_done = now_ns();
+    g_stats.exec_ns += t_done - t_parsed;
+    trace_rec(TR_LINE, t_parsed, t_done, 0, line_no, NULL);
+}
+
+// --serve: tells the client how the line went, after all of its output
+static void session_status(unsigned long errors) {
+    int status = 0;
+    if (g_njobs) {
+        int st = g_jobs[g_njobs - 1].status;
+        status = WIFSIGNALED(st) ? 128 + WTERMSIG(st) : WEXITSTATUS(st);
+    }
+    printf("wish: status %d, %lu errors\n", status, g_errors - errors);
+    fflush(stdout);
+}
+
+// Reads and runs lines from `in` until EOF (or the `exit` builtin)
+static void run_input(struct input *in, int interactive) {
+    while (1) {
+        // show prompt only in interactive mode (after any finished
+        // background jobs)
+        if (interactive) {
+            if (g_nbg)
+                bg_report(0);
+            printf("wish> ");
+            fflush(stdout);
+        }
+
+        // read one line of input at a time until EOF and then exit
+        // (or take it already parsed from the lookahead queue)
+        size_t n;
+        struct cmdlist cl;
+        uint64_t t_read = g_trace ? now_ns() : 0;
+        uint64_t t_start, t_parsed;
+        if (lookahead_take(&cl)) {
+            t_start = t_parsed = now_ns();
+        } else if (in->cw) {
+            // --precompile: already parsed on disk
+            t_start = now_ns();
+            if (!input_parse(in, &g_line_arena, &cl)) {
+                g_incr_complete = 1;
+                break;
+            }
+            t_parsed = now_ns();
+        } else {
+            char *line = input_next(in, &n);
+            if (!line) {
+                g_incr_complete = 1;
+                break;
             }
 
-            // close the original file descriptor
-            close(fd);
+            // cut the line into '&' segments, argv and redirect targets
+            t_start = now_ns();
+            lex_line(&g_line_arena, line, n, &cl);
+            t_parsed = now_ns();
         }
+        g_stats.lines++;
+        g_stats.parse_ns += t_parsed - t_start;
+        trace_rec(TR_READ, t_read, t_start, 0, (long)g_stats.lines, NULL);
+        trace_rec(TR_PARSE, t_start, t_parsed, 0, (long)g_stats.lines, NULL);
 
-        // replace the child process with the new program
-        execv(prog, argv);
+        unsigned long errors = g_errors;
+        run_line(&cl, in, interactive, t_parsed);
+        if (g_session)
+            session_status(errors);
 
-        // if the execv fails, print error and exit child
+        // everything parsed from this line goes away at once
+        arena_reset(&g_line_arena);
+        lookahead_release();
+    }
+}
+
+/* ===========================================================
+   ==========            SOURCED FILES               ==========
+   =========================================================== */
+
+/*
+ * `source FILE` runs FILE's lines inline, one full line at a time, with
+ * the shell's current cwd and PATH. A file is read and lexed once into
+ * an entry of its own (text, arena and cmdlists) and the entry is kept:
+ * later sources of the same file (dev/ino) only stat() it and run the
+ * cached lines. A different mtime or size makes it read again; an entry
+ * still running further up the stack is freed once that run is done.
+ */
+#define SOURCE_MAX_DEPTH 64
+
+struct source_file {
+    struct source_file *next;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char *text;            // the file, cut up in place by lex_line()
+    struct arena arena;    // its lines' cmdlists
+    struct cmdlist *lines;
+    size_t nlines;
+    int busy;              // sources of it in progress
+    int stale;             // no longer in the cache; free when not busy
+};
+
+static struct source_file *g_sources = NULL;
+static size_t g_source_depth = 0;
+// per-line arenas for the lines run at each depth (g_line_arena still
+// holds the line that called `source`)
+static struct arena g_source_arena[SOURCE_MAX_DEPTH];
+
+static void source_file_free(struct source_file *sf) {
+    arena_free(&sf->arena);
+    free(sf->lines);
+    free(sf->text);
+    free(sf);
+}
+
+// Reads and lexes `path`; NULL (after err()) if it can't be read
+static struct source_file *source_load(const char *path) {
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
         err();
-        _exit(1);
-    } else {
-        // parent process: just free the program path
-        free(prog);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        err();
+        close(fd);
+        return NULL;
+    }
+
+    struct source_file *sf = calloc(1, sizeof *sf);
+    char *text = malloc((size_t)st.st_size + 1);
+    if (!sf || !text) { err(); exit(1); }
+    if (read_full(fd, text, (size_t)st.st_size) != 0) {
+        err();
+        close(fd);
+        free(text);
+        free(sf);
+        return NULL;
+    }
+    close(fd);
+    sf->dev = st.st_dev;
+    sf->ino = st.st_ino;
+    sf->mtime = st.st_mtim;
+    sf->size = st.st_size;
+    sf->text = text;
+
+    uint64_t t0 = now_ns();
+    size_t cap = 0;
+    char *p = text, *end = text + st.st_size;
+    *end = '\0';
+    while (p < end) {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        char *next = p + n + 1;
+        while (n > 0 && p[n-1] == '\r')
+            n--;
+        p[n] = '\0';
 
-        // return the child's PID to the caller
-        return pid; 
+        if (sf->nlines == cap) {
+            cap = cap ? cap * 2 : 16;
+            sf->lines = realloc(sf->lines, cap * sizeof *sf->lines);
+            if (!sf->lines) { err(); exit(1); }
+        }
+        lex_line(&sf->arena, p, n, &sf->lines[sf->nlines++]);
+        p = next;
     }
+    g_stats.parse_ns += now_ns() - t0;
+    return sf;
 }
 
+// The cached entry for `path`, (re)loaded if the file changed
+static struct source_file *source_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        err();
+        return NULL;
+    }
 
-// ========== main loop ==========
-int main(int argc, char *argv[]) {
-    // 'in' is where we are reading commands from, either stdin or a file
-    FILE *in = NULL;
-    // interactive is 1 if we should show a prompt, 0 if running in batch mode
-    int interactive = 1;
+    for (struct source_file **pp = &g_sources; *pp; pp = &(*pp)->next) {
+        struct source_file *sf = *pp;
+        if (sf->dev != st.st_dev || sf->ino != st.st_ino)
+            continue;
+        if (sf->size == st.st_size && sf->mtime.tv_sec == st.st_mtim.tv_sec &&
+            sf->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            return sf;
 
-    // determine input source
+        // changed since it was lexed
+        *pp = sf->next;
+        if (sf->busy)
+            sf->stale = 1;
+        else
+            source_file_free(sf);
+        break;
+    }
 
-    // if there are no arguments, read from stdin (interactive mode)
-    if (argc == 1) {
-        in = stdin;
-        interactive = 1;
-    } 
-    // if there is one argument, read from the specified file (batch mode)
-    else if (argc == 2) {
-        in = fopen(argv[1], "r");
-        
-        // if the file cannot be opened, print error and exit
-        if (!in) { 
-            err(); 
-            exit(1);
+    struct source_file *sf = source_load(path);
+    if (sf) {
+        sf->next = g_sources;
+        g_sources = sf;
+    }
+    return sf;
+}
+
+/*
+ * source_run():
+ * Runs the lines of `path` as if they stood in place of the line that
+ * sourced it. That line's children started so far finish first.
+ */
+static void source_run(const char *path) {
+    if (g_source_depth == SOURCE_MAX_DEPTH) {
+        err(); // sources itself, most likely
+        return;
+    }
+    struct source_file *sf = source_get(path);
+    if (!sf)
+        return;
+
+    jobs_wait_all();
+    sf->busy++;
+    uint64_t exec_ns = g_stats.exec_ns; // the sourcing line counts all of it
+    struct arena outer = g_line_arena;
+    g_line_arena = g_source_arena[g_source_depth];
+    g_source_arena[g_source_depth++] = (struct arena){ 0 }; // `exit` frees it as g_line_arena
+
+    for (size_t i = 0; i < sf->nlines; i++) {
+        g_stats.lines++;
+        run_line(&sf->lines[i], NULL, 0, now_ns());
+        arena_reset(&g_line_arena);
+    }
+
+    g_stats.exec_ns = exec_ns;
+    g_source_arena[--g_source_depth] = g_line_arena;
+    g_line_arena = outer;
+    if (--sf->busy == 0 && sf->stale)
+        source_file_free(sf);
+}
+
+static void source_free(void) {
+    while (g_sources) {
+        struct source_file *next = g_sources->next;
+        source_file_free(g_sources);
+        g_sources = next;
+    }
+    for (size_t i = 0; i < SOURCE_MAX_DEPTH; i++)
+        arena_free(&g_source_arena[i]);
+}
+
+/* ===========================================================
+   ==========         BATCH WORKER POOL              ==========
+   =========================================================== */
+
+/*
+ * With -P N the shell takes any number of batch files (a directory
+ * stands for the files in it, in name order) and runs up to N of them
+ * at once. The pool process sets up PATH, the PATH index and the fork
+ * server once; each file gets its own worker, forked from that warm
+ * state and run like a one-file `wish file`, so `cd` and `path` stay
+ * private to their script and nothing is exec'd or re-read to get a
+ * fresh shell. -j and the other options apply inside every worker.
+ *
+ * Workers leave their counters in a shared mapping when they shut down;
+ * the pool adds them up and prints aggregate throughput to stderr at
+ * the end (plus the merged --stats summary when asked for). A file
+ * counts as failed if it can't be run or its script reported errors.
+ */
+static size_t g_pool_workers = 0; // -P; 0 = one file, no pool
+
+// Appends one file to the pool's list (takes ownership of `file`)
+static void pool_push(char ***files, size_t *n, size_t *cap, char *file) {
+    if (!file) { err(); exit(1); }
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *files = realloc(*files, *cap * sizeof **files);
+        if (!*files) { err(); exit(1); }
+    }
+    (*files)[(*n)++] = file;
+}
+
+// Appends `path`, or the files inside it for a directory
+static void pool_add_path(char ***files, size_t *n, size_t *cap, const char *path) {
+    struct dirent **ents;
+    struct stat st;
+    int nents;
+
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        (nents = scandir(path, &ents, NULL, alphasort)) < 0) {
+        pool_push(files, n, cap, strdup(path)); // the worker reports any error
+        return;
+    }
+
+    for (int i = 0; i < nents; i++) {
+        const char *name = ents[i]->d_name;
+        if (name[0] != '.' && ents[i]->d_type != DT_DIR) {
+            size_t need = strlen(path) + strlen(name) + 2;
+            char *file = malloc(need);
+            if (file)
+                snprintf(file, need, "%s/%s", path, name);
+            pool_push(files, n, cap, file);
         }
-        interactive = 0;
-    } 
-    // if there is more than one argument, error and exit
-    else {
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+// Runs one batch file to completion in a fresh worker; never returns.
+// `zy` is its fork server connection (or -1).
+static void pool_worker(const char *file, int zy) {
+    shell_fork_init(zy);
+    struct input in;
+    if (input_open(&in, file) != 0) {
         err();
         exit(1);
     }
+    input_precompile(&in, file);
+    incr_open(file);
+    run_input(&in, 0);
+    input_close(&in);
+    shell_shutdown();
+    exit(exit_status());
+}
 
-    // initialize PATH list to ["/bin", NULL]
-    path_init();
+// Folds one worker's counters into g_stats
+static void stats_merge(const struct stats *w) {
+    g_stats.lines += w->lines;
+    g_stats.skipped += w->skipped;
+    g_stats.jobs += w->jobs;
+    g_stats.wall_ns += w->wall_ns;
+    g_stats.user_ns += w->user_ns;
+    g_stats.sys_ns += w->sys_ns;
+    if (w->maxrss_kb > g_stats.maxrss_kb)
+        g_stats.maxrss_kb = w->maxrss_kb;
+    g_stats.spawn_ns += w->spawn_ns;
+    g_stats.throttled += w->throttled;
+    g_stats.retries += w->retries;
+    g_stats.dropped += w->dropped;
+    g_stats.backoff_ns += w->backoff_ns;
+    if (w->min_cap && (!g_stats.min_cap || w->min_cap < g_stats.min_cap))
+        g_stats.min_cap = w->min_cap;
+    g_stats.pressure_holds += w->pressure_holds;
+    g_stats.pressure_ns += w->pressure_ns;
+    g_stats.parse_ns += w->parse_ns;
+    g_stats.exec_ns += w->exec_ns;
+    for (size_t i = 0; i < w->nslow; i++) {
+        struct slow_cmd *sc = stats_slow_slot(w->slow[i].wall_ns);
+        if (sc)
+            *sc = w->slow[i];
+    }
+}
 
-    // buffer for getline()
-    char *line = NULL;
-    size_t cap = 0;
+// Runs every file with at most g_pool_workers at a time; returns the exit status
+static int pool_run(char **paths, size_t npaths) {
+    char **files = NULL;
+    size_t nfiles = 0, cap = 0;
+    for (size_t i = 0; i < npaths; i++)
+        pool_add_path(&files, &nfiles, &cap, paths[i]);
+    if (nfiles == 0) {
+        err();
+        return 1;
+    }
 
-    // main shell loop
-    while (1) {
-        // show prompt only in interactive mode
-        if (interactive) {
-            printf("wish> ");
-            fflush(stdout);
+    // one stats block per file, written by its worker at shutdown
+    size_t map_len = nfiles * sizeof(struct stats);
+    struct stats *slots = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) { err(); exit(1); }
+
+    uint64_t t0 = now_ns();
+    shell_init(1);
+    size_t next = 0, running = 0, failed = 0;
+    fflush(stdout);
+    while (next < nfiles || running > 0) {
+        if (next < nfiles && running < g_pool_workers) {
+            pathidx_sync(); // the snapshot the worker starts from
+            int zy = g_zygote_fd >= 0 ? zygote_attach(-1) : -1;
+            pid_t pid = g_zygote_fd >= 0 && zy < 0 ? -1 : fork();
+            if (pid == 0) {
+                g_pool_slot = &slots[next];
+                pool_worker(files[next], zy);
+            }
+            if (zy >= 0)
+                close(zy);
+            if (pid < 0) {
+                err();
+                failed++;
+            } else {
+                running++;
+            }
+            next++;
+            continue;
         }
 
-        // read one line of input at a time until EOF and then exit
-        ssize_t n = getline(&line, &cap, in);
-        if (n == -1) break;
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break; // ECHILD: nothing left to wait for
+        }
+        running--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    double secs = (double)(now_ns() - t0) / 1e9;
+
+    for (size_t i = 0; i < nfiles; i++)
+        stats_merge(&slots[i]);
+    fprintf(stderr, "pool: %zu files (%zu failed), %zu workers, %.3fs, "
+            "%lu lines (%.0f/s), %lu jobs (%.0f/s)\n",
+            nfiles, failed, g_pool_workers, secs,
+            g_stats.lines, secs > 0 ? (double)g_stats.lines / secs : 0.0,
+            g_stats.jobs, secs > 0 ? (double)g_stats.jobs / secs : 0.0);
+
+    munmap(slots, map_len);
+    for (size_t i = 0; i < nfiles; i++)
+        free(files[i]);
+    free(files);
+    shell_shutdown(); // prints the merged --stats summary
+    return failed ? 1 : 0;
+}
+
+
+// ========== main loop ==========
+/* ===========================================================
+   ==========             SERVER MODE                ==========
+   =========================================================== */
+
+/*
+ * `wish --serve=SOCKET [file]` sets up once and then takes sessions
+ * over a Unix socket:
+ *   - PATH, the PATH index and the fork server are set up once
+ *   - the optional file runs first, e.g. to set the path every
+ *     session should start with
+ *   - each connection gets a session forked from the warm server, with
+ *     its own cwd (the client's, when it can be read) and its own path
+ *
+ * The resolve cache and the PATH index come along with the fork. The
+ * zygote forks each session a helper of its own, so the sessions share
+ * the small warm image without sharing one socket.
+ *
+ * The client streams lines in. The session's stdin, stdout and stderr
+ * are the connection, so output streams back as the line runs. Once a
+ * line's children are reaped, the session answers
+ *
+ *   wish: status N, E errors
+ *
+ * N is the exit status of the line's last process (128+signal if it was
+ * killed). E is how many errors the line reported. The session ends at
+ * EOF or `exit`. `wish --connect=SOCKET [file]` is a minimal client that
+ * copies the file (or stdin) in and everything that comes back to
+ * stdout. SIGTERM or SIGINT stops the server and removes the socket.
+ * Running sessions carry on.
+ */
+static int g_serve_stop = 0;
+
+static void serve_on_stop(struct ev_source *src, uint32_t events);
+static void serve_on_accept(struct ev_source *src, uint32_t events);
+static struct ev_source g_ev_serve_stop = { -1, serve_on_stop };
+static struct ev_source g_ev_listen = { -1, serve_on_accept };
+
+static void serve_on_stop(struct ev_source *src, uint32_t events) {
+    (void)events;
+    struct signalfd_siginfo si;
+    while (read(src->fd, &si, sizeof si) > 0) {
+    }
+    g_serve_stop = 1;
+}
+
+// Runs one session on `conn`; never returns. `zy` is its fork server
+// connection (or -1).
+static void serve_session(int conn, int zy) {
+    close(g_ev_listen.fd);
+    close(g_ev_serve_stop.fd);
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &stop, NULL);
+
+    // start where the client is, if we may look
+    struct ucred cr;
+    socklen_t len = sizeof cr;
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cr, &len) == 0 && cr.pid > 0) {
+        char cwd[64];
+        snprintf(cwd, sizeof cwd, "/proc/%d/cwd", (int)cr.pid);
+        if (chdir(cwd) != 0) {
+            // keep the server's
+        }
+    }
+    if (dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0 ||
+        dup2(conn, STDERR_FILENO) < 0)
+        _exit(1);
+    close(conn);
+
+    g_session = 1;
+    shell_fork_init(zy);
+
+    struct input in;
+    input_stream(&in, STDIN_FILENO);
+    run_input(&in, 0);
+    input_close(&in);
+    shell_shutdown();
+    exit(0);
+}
 
-        // strip trailing newlines
-        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+static void serve_on_accept(struct ev_source *src, uint32_t events) {
+    (void)events;
+    int conn;
+    while ((conn = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        pathidx_sync(); // the snapshot the session starts from
 
-        // split by '&' for parallel commands
-        char **segments = split_tokens(line, "&");
-        
-        // if split_tokens fails, print error and continue to next line
-        if (!segments) {
+        int zy = -1;
+        if (g_zygote_fd >= 0 && (zy = zygote_attach(conn)) < 0) {
             err();
+            close(conn);
             continue;
         }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+            serve_session(conn, zy);
+        if (pid < 0)
+            err();
+        close(conn);
+        if (zy >= 0)
+            close(zy);
+    }
+}
 
-        // collect child PIDs to wait for them all later
-        size_t started = 0;
+// Opens a Unix stream socket on `path`: listening, or connected to it
+static int serve_socket(const char *path, int listening) {
+    struct sockaddr_un sa = { 0 };
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof sa.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
 
-        // arbitrary limit (enough for tests)
-        pid_t kids[256]; 
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (listening ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0)
+        return -1;
+    if (!listening) {
+        if (connect(fd, (struct sockaddr *)&sa, sizeof sa) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
 
-        // process each command segment separately
-        for (size_t i=0; segments[i]; i++) {
-            char *redir = NULL;
-            // parse_cmd_with_redir makes sure that we don't use more than one >, only one filename after >, and makes cmd = argv[]
-            char **cmd = parse_cmd_with_redir(segments[i], &redir);
-            
-            // if parsing fails, print error and skip this segment
-            if (!cmd) { 
-                free(redir); 
-                continue; 
-            }
+    // a socket left behind by an earlier server; anything else stays
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-            // skip empty commands (like "ls && pwd")
-            if (!cmd[0]) { 
-                free_argv(cmd); 
-                free(redir); 
-                continue; 
-            }
+/*
+ * serve_main():
+ * --serve: sets up, runs `file` (if any), then forks a session per
+ * connection until SIGTERM or SIGINT.
+ */
+static int serve_main(const char *file) {
+    struct input in;
+    if (file && input_open(&in, file) != 0) {
+        err();
+        exit(1);
+    }
+
+    // the fork server ignores SIGINT and SIGTERM, so a ^C reaches us
+    // first; it goes when we do (PR_SET_PDEATHSIG)
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    shell_init(1);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    if (file) {
+        run_input(&in, 0);
+        input_close(&in);
+    }
+
+    int lfd = serve_socket(g_serve_path, 1);
+    if (lfd < 0) {
+        err();
+        shell_shutdown();
+        return 1;
+    }
+
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    sigprocmask(SIG_BLOCK, &stop, NULL);
+    int sfd = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) { err(); exit(1); }
+    ev_add(&g_ev_serve_stop, sfd, EPOLLIN);
+    ev_add(&g_ev_listen, lfd, EPOLLIN);
+
+    while (!g_serve_stop)
+        ev_run(-1);
+
+    close(lfd);
+    close(sfd);
+    unlink(g_serve_path);
+    shell_shutdown();
+    return 0;
+}
 
-            // check for built-ins like exit, cd, or PATH (execute immediately)
-            if (handle_builtin(cmd)) {
-                free_argv(cmd);
-                free(redir);
+/*
+ * client_main():
+ * --connect: streams `file` (or stdin) to the server and copies what
+ * comes back to stdout until the session ends. Input is only read as
+ * fast as the session takes it, so a chatty line can't wedge both sides.
+ */
+static int client_main(const char *file) {
+    int in = STDIN_FILENO;
+    if (file && (in = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+        err();
+        return 1;
+    }
+    int s = serve_socket(g_connect_path, 0);
+    if (s < 0 || fcntl(s, F_SETFL, O_NONBLOCK) != 0) {
+        err();
+        return 1;
+    }
+
+    char up[65536], down[65536];
+    size_t off = 0, len = 0; // input read but not yet sent
+    struct pollfd pf[2] = { { in, POLLIN, 0 }, { s, POLLIN, 0 } };
+    for (;;) {
+        pf[0].events = len ? 0 : POLLIN;
+        pf[1].events = POLLIN | (len ? POLLOUT : 0);
+        if (poll(pf, 2, -1) < 0) {
+            if (errno == EINTR)
                 continue;
+            err();
+            return 1;
+        }
+
+        if (!len && pf[0].revents) { // (POLLHUP comes even when not asked for)
+            ssize_t r = read(in, up, sizeof up);
+            if (r > 0) {
+                off = 0;
+                len = (size_t)r;
+            } else if (r == 0 || errno != EINTR) {
+                shutdown(s, SHUT_WR); // the session sees EOF
+                pf[0].fd = -1;
+            }
+        }
+        if (len && (pf[1].revents & POLLOUT)) {
+            ssize_t w = send(s, up + off, len, MSG_NOSIGNAL);
+            if (w > 0) {
+                off += (size_t)w;
+                len -= (size_t)w;
+            } else if (w < 0 && errno != EAGAIN && errno != EINTR) {
+                len = 0;
+                pf[0].fd = -1;
+            }
+        }
+        if (pf[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = read(s, down, sizeof down);
+            if (r > 0) {
+                if (write_all_fd(STDOUT_FILENO, down, (size_t)r) != 0)
+                    break;
+            } else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                break; // the session is over
             }
+        }
+    }
+    close(s);
+    if (in != STDIN_FILENO)
+        close(in);
+    return 0;
+}
 
-            // run the external command (handles forking internally)
-            pid_t pid = run_external(cmd, redir);
+int main(int argc, char *argv[]) {
+    // 'in' is where we are reading commands from, either stdin or a file
+    struct input in;
+    // interactive is 1 if we should show a prompt, 0 if running in batch mode
+    int interactive = 1;
 
-            if (pid > 0 && started < sizeof(kids)/sizeof(kids[0])) {
-                // save child PID in array to wait for it later
-                kids[started++] = pid;
+    // pull out -options; whatever is left is the batch file(s)
+    char **files = calloc((size_t)argc, sizeof *files);
+    if (!files) { err(); exit(1); }
+    int nfiles = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            files[nfiles++] = argv[i];
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            // -j N or -jN: cap on parallel children (0 = unlimited)
+            const char *num = argv[i][2] ? argv[i] + 2 : argv[++i];
+            if (i >= argc || parse_count(num, &g_max_jobs) != 0) {
+                err();
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "-P", 2) == 0) {
+            // -P N or -PN: run many batch files, N at a time (0 = one per CPU)
+            const char *num = argv[i][2] ? argv[i] + 2 : argv[++i];
+            if (i >= argc || parse_count(num, &g_pool_workers) != 0) {
+                err();
+                exit(1);
+            }
+            if (g_pool_workers == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                g_pool_workers = cpus > 0 ? (size_t)cpus : 1;
+            }
+        } else if (strcmp(argv[i], "--capture=ordered") == 0) {
+            g_capture = CAPTURE_ORDERED;
+        } else if (strcmp(argv[i], "--capture=lines") == 0) {
+            g_capture = CAPTURE_LINES;
+        } else if (strncmp(argv[i], "--capture-cap=", 14) == 0) {
+            if (parse_count(argv[i] + 14, &g_capture_cap) != 0) {
+                err();
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--affinity=", 11) == 0) {
+            // --affinity=CPULIST, --affinity=numa or --affinity=numa:NODELIST
+            char *spec = argv[i] + 11;
+            char *nodes = strncmp(spec, "numa:", 5) == 0 ? spec + 5 : NULL;
+            if (nodes)
+                spec[4] = '\0';
+            if (affinity_set(spec, nodes) != 0) {
+                err();
+                exit(1);
             }
+        } else if (strcmp(argv[i], "--cgroup") == 0) {
+            g_cg_dir = "";
+        } else if (strncmp(argv[i], "--cgroup=", 9) == 0 && argv[i][9]) {
+            g_cg_dir = argv[i] + 9;
+        } else if (strcmp(argv[i], "--cgroup-per=line") == 0) {
+            g_cg_per = CG_PER_LINE;
+        } else if (strcmp(argv[i], "--cgroup-per=job") == 0) {
+            g_cg_per = CG_PER_JOB;
+        } else if (strncmp(argv[i], "--cgroup-limit=", 15) == 0) {
+            if (cg_add_limit(argv[i] + 15) != 0) {
+                err();
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--pressure=", 11) == 0) {
+            if (pressure_parse(argv[i] + 11) != 0) {
+                err();
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8]) {
+            free(g_trace_path);
+            g_trace_path = abs_path(argv[i] + 8); // opened at exit, after any cd
+        } else if (strncmp(argv[i], "--lookahead=", 12) == 0) {
+            if (parse_count(argv[i] + 12, &g_ahead_k) != 0) {
+                err();
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            g_incr = 1;
+        } else if (strncmp(argv[i], "--incremental=", 14) == 0 && argv[i][14]) {
+            g_incr = 1;
+            g_incr_path = abs_path(argv[i] + 14);
+        } else if (strcmp(argv[i], "--precompile") == 0) {
+            g_precompile = "";
+        } else if (strncmp(argv[i], "--precompile=", 13) == 0 && argv[i][13]) {
+            g_precompile = argv[i] + 13;
+        } else if (strcmp(argv[i], "--inline") == 0) {
+            g_inline = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            g_stats_at_exit = 1;
+        } else if (strcmp(argv[i], "--spawn=posix") == 0) {
+            g_spawn = SPAWN_POSIX;
+        } else if (strcmp(argv[i], "--spawn=fork") == 0) {
+            g_spawn = SPAWN_FORK;
+        } else if (strcmp(argv[i], "--spawn=zygote") == 0) {
+            g_spawn = SPAWN_ZYGOTE;
+        } else if (strcmp(argv[i], "--spawn=remote") == 0) {
+            g_spawn = SPAWN_REMOTE;
+        } else if (strncmp(argv[i], "--remote=", 9) == 0 && argv[i][9]) {
+            g_remote_file = argv[i] + 9;
+        } else if (strcmp(argv[i], "--agent") == 0) {
+            g_agent = 1;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0 && argv[i][8]) {
+            g_serve_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--connect=", 10) == 0 && argv[i][10]) {
+            g_connect_path = argv[i] + 10;
+        } else {
+            // unknown option
+            err();
+            exit(1);
+        }
+    }
+
+    if (g_agent) {
+        free(files);
+        return agent_main();
+    }
+    if (g_spawn == SPAWN_REMOTE && !g_remote_file) {
+        err();
+        exit(1);
+    }
+    if (g_connect_path) {
+        if (nfiles > 1) {
+            err();
+            exit(1);
+        }
+        int rc = client_main(nfiles ? files[0] : NULL);
+        free(files);
+        return rc;
+    }
 
-            free_argv(cmd);
-            free(redir);
+    // one agent connection can't be shared by forked sessions, and
+    // there's no batch file to keep records for
+    if (g_serve_path) {
+        if (nfiles > 1 || g_pool_workers || g_spawn == SPAWN_REMOTE || g_incr) {
+            err();
+            exit(1);
         }
+        int rc = serve_main(nfiles ? files[0] : NULL);
+        free(files);
+        return rc;
+    }
 
-        // wait for all child processes to finish
-        for (size_t i=0; i<started; i++) {
-            // waitpid can be interrupted by signals, so we loop until it succeeds
-            while (waitpid(kids[i], NULL, 0) < 0 && errno == EINTR) {
-            }
+    // many files (or a directory) go to the worker pool; each
+    // keeps its own incremental records
+    if (g_pool_workers) {
+        if (nfiles == 0 || g_incr_path) {
+            err();
+            exit(1);
         }
+        int rc = pool_run(files, (size_t)nfiles);
+        free(files);
+        return rc;
+    }
+
+    // determine input source
 
-        // free memory allocated for command segments
-        free_argv(segments);
+    // if there are no arguments, read from stdin (interactive mode)
+    if (nfiles == 0) {
+        input_stream(&in, STDIN_FILENO);
+        interactive = 1;
+    } 
+    // if there is one argument, read from the specified file (batch mode)
+    else if (nfiles == 1) {
+        // if the file cannot be opened, print error and exit
+        if (input_open(&in, files[0]) != 0) { 
+            err(); 
+            exit(1);
+        }
+        interactive = 0;
+    } 
+    // if there is more than one argument, error and exit
+    else {
+        err();
+        exit(1);
     }
+    if (nfiles)
+        input_precompile(&in, files[0]);
+    incr_open(nfiles ? files[0] : NULL);
+    free(files);
+
+    shell_init(0);
+
+    // main shell loop
+    run_input(&in, interactive);
 
     // cleanup on EOF
-    free(line);
-    path_free();
+    input_close(&in);
+    shell_shutdown();
     return 0;
-}
\ No newline at end of file
+}